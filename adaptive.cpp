@@ -0,0 +1,189 @@
+#include "adaptive.h"
+
+#include <algorithm>
+#include <cmath>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+static constexpr char state_magic[8] = {'F', 'B', 'K', 'A', 'D', 'P', 'T', '1'};
+static constexpr uint32_t state_version = 2;
+
+static int64_t unix_time() {
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void Baseline::add(float sample) {
+	if (n == 0) {
+		mean = sample;
+		var = 0;
+	} else {
+		// West's incremental update of the exponentially weighted mean and variance
+		float diff = sample - mean;
+		float incr = alpha * diff;
+		mean += incr;
+		var = (1 - alpha) * (var + diff * incr);
+	}
+	if (n < UINT32_MAX)
+		n++;
+}
+
+AdaptiveThresholds::AdaptiveThresholds(std::vector<WatchRoot> const& roots, std::string state_file)
+	: roots(roots), state_file(std::move(state_file)) {
+	if (!this->state_file.empty())
+		load();
+}
+
+Baseline* AdaptiveThresholds::baselineFor(std::string const& cgroup_dir) {
+	auto it = cgroups.find(cgroup_dir);
+	if (it == cgroups.end()) {
+		if (cgroups.size() >= max_cgroups)
+			prune(std::chrono::seconds{0});
+		if (cgroups.size() >= max_cgroups)
+			return nullptr;
+		it = cgroups.emplace(cgroup_dir, Baseline{}).first;
+	}
+	it->second.users++;
+	return &it->second;
+}
+
+void AdaptiveThresholds::release(Baseline* cgroup) {
+	if (!cgroup)
+		return;
+	cgroup->users--;
+	cgroup->last_active = unix_time();
+}
+
+void AdaptiveThresholds::prune(std::chrono::seconds max_age) {
+	const int64_t oldest = unix_time() - max_age.count();
+	size_t n_before = cgroups.size();
+	std::erase_if(cgroups, [&](auto& c) { return !c.second.users && c.second.last_active <= oldest; });
+	if (cgroups.size() != n_before) {
+		spdlog::debug("Dropped the adaptive baselines of {} cgroups that are gone", n_before - cgroups.size());
+		dirty = true;
+	}
+}
+
+void AdaptiveThresholds::learn(Baseline* cgroup, uint64_t events, unsigned thresh) {
+	// A window that came close to its threshold might be a forkbomb ramping up
+	if (!cgroup || events >= max_learned_fraction * thresh)
+		return;
+	cgroup->add(events);
+	dirty = true;
+}
+
+unsigned AdaptiveThresholds::threshold(Baseline const* cgroup, unsigned root, unsigned previous) const {
+	const unsigned configured = roots[root].event_thresh;
+	if (!cgroup || !cgroup->trained())
+		return configured;
+
+	float stddev = std::max({std::sqrt(cgroup->var), min_rel_stddev * cgroup->mean, 1.f});
+	float t = std::ceil(cgroup->mean + sigmas * stddev);
+	t = std::min(t, std::floor(max_growth * previous));
+	t = std::clamp(t, static_cast<float>(configured), max_factor * configured);
+	return std::max(1u, static_cast<unsigned>(t));
+}
+
+void AdaptiveThresholds::load() {
+	int fd = open(state_file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			spdlog::warn("Could not open adaptive state \"{}\": {}", state_file, strerror(errno));
+		return;
+	}
+	std::string data;
+	char buffer[4096];
+	ssize_t n_bytes;
+	while ((n_bytes = read(fd, buffer, sizeof(buffer))) > 0)
+		data.append(buffer, n_bytes);
+	close(fd);
+
+	StateHeader h;
+	if (n_bytes >= 0 && data.size() >= sizeof(h))
+		memcpy(&h, data.data(), sizeof(h));
+	if (n_bytes < 0 || data.size() < sizeof(h) || memcmp(h.magic, state_magic, sizeof(state_magic)) ||
+		h.version != state_version) {
+		spdlog::warn("Ignoring adaptive state \"{}\": not a valid state file", state_file);
+		return;
+	}
+
+	size_t offset = sizeof(h);
+	unsigned n_cgroups = 0;
+	for (uint32_t i = 0; i < h.n_entries; i++) {
+		StateEntry e;
+		if (offset + sizeof(e) > data.size())
+			break;
+		memcpy(&e, data.data() + offset, sizeof(e));
+		offset += sizeof(e);
+		if (offset + e.path_len > data.size())
+			break;
+		std::string path = data.substr(offset, e.path_len);
+		offset += e.path_len;
+
+		if (!e.is_root && cgroups.size() < max_cgroups) {
+			cgroups[path] = Baseline{.mean = e.mean, .var = e.var, .n = e.n, .users = 0, .last_active = e.last_active};
+			n_cgroups++;
+		}
+	}
+	spdlog::info("Loaded adaptive baselines of {} cgroups from \"{}\"", n_cgroups, state_file);
+}
+
+void AdaptiveThresholds::saveIfChanged() {
+	if (dirty)
+		save();
+}
+
+void AdaptiveThresholds::save() {
+	if (state_file.empty())
+		return;
+	// Only what is alive or might come back is worth persisting
+	prune(max_idle);
+	dirty = false;
+	const int64_t now = unix_time();
+
+	std::string data;
+	StateHeader h;
+	memcpy(h.magic, state_magic, sizeof(h.magic));
+	h.version = state_version;
+	h.n_entries = 0;
+	data.append(reinterpret_cast<const char*>(&h), sizeof(h));
+
+	for (auto& [path, b] : cgroups) {
+		if (!b.n || path.size() > UINT16_MAX)
+			continue;
+		StateEntry e{.last_active = b.users ? now : b.last_active,
+					 .mean = b.mean,
+					 .var = b.var,
+					 .n = b.n,
+					 .is_root = 0,
+					 .reserved = 0,
+					 .path_len = static_cast<uint16_t>(path.size())};
+		data.append(reinterpret_cast<const char*>(&e), sizeof(e));
+		data.append(path);
+		h.n_entries++;
+	}
+	memcpy(data.data(), &h, sizeof(h));
+
+	// Write to a temporary file first, so that a crash never leaves a truncated state behind
+	std::string tmp = state_file + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		spdlog::error("Could not save adaptive state: open \"{}\" failed: {}", tmp, strerror(errno));
+		return;
+	}
+	ssize_t n_bytes = write(fd, data.data(), data.size());
+	if (n_bytes < 0 || static_cast<size_t>(n_bytes) != data.size() || fsync(fd)) {
+		spdlog::error("Could not save adaptive state: writing \"{}\" failed: {}", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp.c_str());
+		return;
+	}
+	close(fd);
+	if (rename(tmp.c_str(), state_file.c_str()))
+		spdlog::error("Could not save adaptive state: renaming \"{}\" failed: {}", tmp, strerror(errno));
+	else
+		spdlog::debug("Saved adaptive baselines ({} entries) to \"{}\"", h.n_entries, state_file);
+}
@@ -1,12 +1,55 @@
 #include <stdlib.h>
 #include <iostream>
+#include <filesystem>
 #include <getopt.h>
 #include <string>
 
 #include "args.h"
 #include "spdlog/spdlog.h"
 
+bool WatchRoot::is_pattern() const {
+	return path.find_first_of("*?[") != std::string::npos;
+}
+
+static std::string absolute_cgroup_path(std::string const& cgroup_path, std::string const& slice) {
+	std::string path = std::filesystem::path(cgroup_path + "/" + slice).lexically_normal().string();
+	while (path.size() > 1 && path.ends_with("/"))
+		path.pop_back();
+	return path;
+}
+
+// Parse a root given as "<slice>[,window-seconds=<float>][,event-threshold=<int>]".
+// May throw std::invalid_argument or std::out_of_range.
+static WatchRoot parse_root(std::string const& spec, Args const& a) {
+	WatchRoot r{"", a.window_seconds, a.event_thresh};
+	size_t start = 0, end;
+	do {
+		end = spec.find(',', start);
+		std::string part = spec.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		if (start == 0) {
+			r.path = absolute_cgroup_path(a.cgroup_path, part);
+		} else if (part.starts_with("window-seconds=")) {
+			r.window_seconds = std::stof(part.substr(15));
+		} else if (part.starts_with("event-threshold=")) {
+			long long val = std::stoll(part.substr(16));
+			if (val < 0 || val >= (1LL << 8 * sizeof(unsigned)))
+				throw std::out_of_range("");
+			r.event_thresh = val;
+		} else {
+			throw std::invalid_argument("");
+		}
+		start = end + 1;
+	} while (end != std::string::npos);
+
+	if (std::filesystem::path(r.path).parent_path().string().find_first_of("*?[") != std::string::npos) {
+		std::cerr << "Error: only the last component of root \"" << spec << "\" may be a pattern" << std::endl;
+		std::exit(1);
+	}
+	return r;
+}
+
 Args::Args(int argc, char** argv) {
+	std::vector<std::string> root_specs, exclude_specs;
 	int choice;
 	while (1) {
 		static struct option long_options[] = {
@@ -16,12 +59,21 @@ Args::Args(int argc, char** argv) {
 			{"slice",           required_argument, 0, 's'},
 			{"window-seconds",  required_argument, 0, 'w'},
 			{"event-threshold", required_argument, 0, 't'},
+			{"snapshot-file",   required_argument, 0, 'f'},
+			{"snapshot-size",   required_argument, 0, 'b'},
+			{"dump-snapshots",  required_argument, 0, 'd'},
+			{"io-uring",        no_argument,       0, 'u'},
+			{"cooldown-seconds", required_argument, 0, 'k'},
+			{"adaptive",        no_argument,       0, 'a'},
+			{"adaptive-state",  required_argument, 0, 'p'},
+			{"root",            required_argument, 0, 'r'},
+			{"exclude",         required_argument, 0, 'x'},
 			{0,0,0,0}
 		};
 
 		int option_index = 0;
 
-		choice = getopt_long( argc, argv, "vhc:s:w:t:", long_options, &option_index);
+		choice = getopt_long( argc, argv, "vhc:s:w:t:k:ap:f:b:d:ur:x:", long_options, &option_index);
 
 		if (choice == -1)
 			break;
@@ -38,9 +90,20 @@ Args::Args(int argc, char** argv) {
 						"Options:\n"
 						"  -h --help                   Print this help message and exit\n"
 						"  -c --cgroup-mnt=<path>      Path where cgroup is mounted [default: " << cgroup_path << "]\n"
-						"  -s --slice=<path>           Slice in which all cgroups should be indexed [default: " << slice_path << "]\n"
+						"  -s --slice=<path>           Slice in which all cgroups should be indexed, if no --root is given [default: " << slice_path << "]\n"
+						"  -r --root=<path>[,window-seconds=<float>][,event-threshold=<int>]\n"
+						"                              Watch this slice with its own policy, may be given multiple times.\n"
+						"                              The last component may be a pattern like \"/system.slice/docker-*.scope\"\n"
+						"  -x --exclude=<path>         Never kill cgroups in this slice, may be given multiple times [default: /user.slice/user-0.slice]\n"
 						"  -w --window-seconds=<float> Window length in seconds for counting failed forks [default: " << window_seconds << "]\n"
 						"  -t --event-threshold=<int>  Threshold for amount of failed forks in time window before killing slice [default: " << event_thresh << "]\n"
+						"  -k --cooldown-seconds=<float> Time in which a cgroup is not killed again after it has been torn down [default: " << cooldown_seconds << "]\n"
+						"  -a --adaptive               Learn per cgroup how many failed forks are normal and adapt the threshold\n"
+						"  -p --adaptive-state=<path>  Keep what has been learned in this file across restarts (implies --adaptive)\n"
+						"  -f --snapshot-file=<path>   Record snapshots of killed cgroups into this ring buffer file [default: none]\n"
+						"  -b --snapshot-size=<bytes>  Size of the snapshot ring buffer, if it is newly created [default: " << snapshot_size << "]\n"
+						"  -d --dump-snapshots=<path>  Print all snapshots recorded in this file and exit\n"
+						"  -u --io-uring               Use io_uring to read events and kill cgroups, if the kernel supports it\n"
 						"  -v --version                Print version and exit"
 						<< std::endl;
 					exit(EXIT_SUCCESS);
@@ -69,6 +132,46 @@ Args::Args(int argc, char** argv) {
 						std::exit(1);
 					}
 				} break;
+				case 'k':
+					cooldown_seconds = std::stof(optarg, &endidx);
+					if (endidx != std::strlen(optarg) || cooldown_seconds < 0) {
+						std::cerr << "Error: \"" << optarg << "\" is not a valid duration" << std::endl;
+						std::exit(1);
+					}
+					break;
+				case 'a':
+					adaptive = true;
+					break;
+				case 'p':
+					adaptive = true;
+					adaptive_state = optarg;
+					break;
+				case 'f':
+					snapshot_file = optarg;
+					break;
+				case 'b': {
+					long long val = std::stoll(optarg, &endidx);
+					if (val < 0) {
+						throw std::out_of_range("");
+					}
+					snapshot_size = val;
+					if (endidx != std::strlen(optarg)) {
+						std::cerr << "Error: \"" << optarg << "\" is not a valid unsigned integer" << std::endl;
+						std::exit(1);
+					}
+				} break;
+				case 'd':
+					dump_snapshots = optarg;
+					break;
+				case 'u':
+					io_uring = true;
+					break;
+				case 'r':
+					root_specs.push_back(optarg);
+					break;
+				case 'x':
+					exclude_specs.push_back(optarg);
+					break;
 				case '?':
 					// getopt_long will have already printed an error
 					break;
@@ -91,5 +194,24 @@ Args::Args(int argc, char** argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	// Resolve roots and excludes only now, so that they do not depend on the order of --cgroup-mnt, --window-seconds etc.
+	if (root_specs.empty())
+		root_specs.push_back(slice_path);
+	for (auto& spec : root_specs) {
+		try {
+			roots.push_back(parse_root(spec, *this));
+		} catch (std::invalid_argument const& e) {
+			std::cerr << "Error: Could not parse root \"" << spec << "\"" << std::endl;
+			std::exit(1);
+		} catch (std::out_of_range const& e) {
+			std::cerr << "Error: a value of root \"" << spec << "\" is out of range" << std::endl;
+			std::exit(1);
+		}
+	}
+	if (exclude_specs.empty())
+		exclude_specs.push_back("/user.slice/user-0.slice");
+	for (auto& spec : exclude_specs)
+		excludes.push_back(absolute_cgroup_path(cgroup_path, spec));
+
 	//std::cout << "Args:\n\tcgroup-mnt=\"" << cgroup_path << "\"\n\tslice=\"" << slice_path << "\"\n\twindows-seconds=\"" << window_seconds << "\"\n\tevent-threshold=" << event_thresh << std::endl;
 }
@@ -0,0 +1,109 @@
+// Compares the plain system call backend with the io_uring backend under a simulated storm:
+// many cgroups trigger at the same time, so a lot of inotify events have to be read and a lot of cgroups have to be
+// killed at once. The cgroups are simulated by plain directories in a temporary directory, so this does not need root.
+#include <chrono>
+#include <err.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <vector>
+
+#include "inotify.h"
+#include "kill.h"
+#include "spdlog/spdlog.h"
+#include "uring.h"
+
+static void write_file(std::filesystem::path const& path, const char* content, int flags = O_CREAT | O_TRUNC) {
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC | flags, 0644);
+	if (fd < 0)
+		err(EXIT_FAILURE, "Could not create %s", path.c_str());
+	if (write(fd, content, strlen(content)) < 0)
+		err(EXIT_FAILURE, "Could not write %s", path.c_str());
+	close(fd);
+}
+
+// Returns the time per cgroup in microseconds
+static double bench_kills(IoUring* ring, std::vector<std::string> const& cgroups, unsigned rounds) {
+	KillBatch kills{ring, nullptr};
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned r = 0; r < rounds; r++) {
+		for (auto& c : cgroups)
+			kills.add(c);
+		kills.flush();
+	}
+	std::chrono::duration<double, std::micro> d = std::chrono::steady_clock::now() - start;
+	return d.count() / rounds / cgroups.size();
+}
+
+// Returns the time per event in microseconds. Only reading the events is measured, not generating them.
+static double bench_events(IoUring* ring, std::vector<std::string> const& cgroups, unsigned rounds) {
+	Inotify i{ring};
+	for (auto& c : cgroups)
+		i.addWatch(c + "pids.events", IN_MODIFY);
+	// Like the signalfd of the daemon: polled while waiting for events, but never readable
+	int idle_fd = eventfd(0, EFD_CLOEXEC);
+	if (idle_fd < 0)
+		err(EXIT_FAILURE, "Could not create eventfd");
+	i.addFdListener(idle_fd, []() {});
+
+	std::chrono::duration<double, std::micro> d{0};
+	for (unsigned r = 0; r < rounds; r++) {
+		// Without O_TRUNC, every write produces exactly one IN_MODIFY event
+		for (auto& c : cgroups)
+			write_file(c + "pids.events", "max 1\n", 0);
+		auto start = std::chrono::steady_clock::now();
+		for (size_t n = 0; n < cgroups.size(); n++)
+			i.readEvent();
+		d += std::chrono::steady_clock::now() - start;
+	}
+	close(idle_fd);
+	return d.count() / rounds / cgroups.size();
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3)
+		errx(EXIT_FAILURE, "usage: %s <cgroup-cnt> <rounds>", argv[0] ?: "<argv[0] missing>");
+	unsigned n_cgroups = strtoul(argv[1], nullptr, 0), rounds = strtoul(argv[2], nullptr, 0);
+	if (!n_cgroups || !rounds)
+		errx(EXIT_FAILURE, "cgroup-cnt and rounds must be positive");
+
+	spdlog::set_level(spdlog::level::warn);
+
+	char tmpl[] = "/tmp/io-storm-bench.XXXXXX";
+	if (!mkdtemp(tmpl))
+		err(EXIT_FAILURE, "Could not create temporary directory");
+	std::filesystem::path root{tmpl};
+
+	std::vector<std::string> cgroups;
+	for (unsigned c = 0; c < n_cgroups; c++) {
+		auto dir = root / ("cgroup-" + std::to_string(c));
+		std::filesystem::create_directory(dir);
+		write_file(dir / "pids.current", "123\n");
+		write_file(dir / "pids.peak", "4096\n");
+		write_file(dir / "pids.max", "4096\n");
+		write_file(dir / "pids.events", "max 1\n");
+		write_file(dir / "cgroup.kill", "");
+		cgroups.push_back(dir.string() + "/");
+	}
+
+	auto ring = IoUring::create(256);
+	if (!ring)
+		std::cout << "io_uring is not available, only measuring plain system calls" << std::endl;
+
+	std::cout << "storm of " << n_cgroups << " cgroups, " << rounds << " rounds\n";
+	std::cout << "kills (us/cgroup):  syscalls " << bench_kills(nullptr, cgroups, rounds);
+	if (ring)
+		std::cout << ", io_uring " << bench_kills(ring.get(), cgroups, rounds);
+	std::cout << "\nevents (us/event):  syscalls " << bench_events(nullptr, cgroups, rounds);
+	if (ring)
+		std::cout << ", io_uring " << bench_events(ring.get(), cgroups, rounds);
+	std::cout << std::endl;
+
+	std::filesystem::remove_all(root);
+}
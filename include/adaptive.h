@@ -0,0 +1,103 @@
+#pragma once
+
+#include <chrono>
+#include <cinttypes>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "args.h"
+
+// Exponentially weighted mean and variance of the number of pids.events changes in a window.
+// Only windows that saw at least one event and did not lead to a kill are counted.
+struct Baseline {
+	float mean = 0;
+	float var = 0;
+	uint32_t n = 0;
+	uint32_t users = 0;      // windows that use this baseline right now, it must not be dropped while there are any
+	int64_t last_active = 0; // unix time at which the cgroup was last seen alive
+
+	static constexpr float alpha = 0.1;        // weight of a new sample
+	static constexpr uint32_t min_samples = 8; // before that, the baseline is not used
+
+	void add(float sample);
+	bool trained() const {
+		return n >= min_samples;
+	}
+};
+
+// Learns per cgroup how many events a window usually has and derives the threshold for the next window from that:
+// mean + sigmas * stddev, but never lower than the configured threshold or higher than max_factor times it. Cgroups
+// that hit their pids.max regularly get some slack, all others keep the configured threshold. So do cgroups without
+// enough history of their own: what their neighbours have learned says nothing about them, and a fresh container is
+// where a forkbomb usually starts. A lower threshold is never learned: only windows with events are counted, so a
+// cgroup that rarely hits pids.max would learn a tiny baseline from those few windows and be killed for its next
+// legitimate burst.
+//
+// Only windows that stayed below max_learned_fraction of their threshold are learned, and the threshold grows by at
+// most max_growth per window: a slow forkbomb that keeps just below its threshold must not be able to raise it.
+//
+// Steady workloads have almost no variance, so the stddev used is at least min_rel_stddev times the mean (and at
+// least 1): a window just a bit busier than usual must not look like a forkbomb.
+//
+// Baselines of cgroups that are gone are kept for max_idle, in case the cgroup comes back under the same name (e.g. a
+// user logging in again or a restarted service), and dropped afterwards.
+//
+// The baselines are kept across restarts in a state file:
+// StateHeader, followed by n_entries times a StateEntry and its path (without NUL). Host byte order.
+class AdaptiveThresholds final {
+public:
+	static constexpr float sigmas = 4;
+	static constexpr float min_rel_stddev = 0.25;
+	static constexpr float max_factor = 4;
+	static constexpr float max_learned_fraction = 0.5;
+	static constexpr float max_growth = 1.25;
+	static constexpr size_t max_cgroups = 65536;
+	static constexpr std::chrono::hours max_idle{24 * 7};
+	static constexpr std::chrono::seconds save_interval{60}; // how often the owner should call saveIfChanged()
+
+	struct StateHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t n_entries;
+	};
+	struct StateEntry {
+		int64_t last_active;
+		float mean;
+		float var;
+		uint32_t n;
+		uint8_t is_root; // always 0, older versions also stored a baseline per root, these are ignored
+		uint8_t reserved;
+		uint16_t path_len;
+	};
+
+private:
+	std::vector<WatchRoot> const& roots;
+	std::unordered_map<std::string, Baseline> cgroups; // cgroup directory (with trailing slash) -> baseline
+	std::string state_file;
+	bool dirty = false;
+
+	void load();
+	// Drop the baselines of cgroups that have been gone for longer than @max_age.
+	void prune(std::chrono::seconds max_age);
+
+public:
+	// @state_file may be empty, then nothing is persisted.
+	AdaptiveThresholds(std::vector<WatchRoot> const& roots, std::string state_file);
+
+	// Returns the baseline of the cgroup in @cgroup_dir, or nullptr if there are too many cgroups already.
+	// The pointer stays valid until it is handed back with release().
+	Baseline* baselineFor(std::string const& cgroup_dir);
+	// The cgroup of @cgroup (may be nullptr) is not watched anymore.
+	void release(Baseline* cgroup);
+
+	// A window of a cgroup (with baseline @cgroup, may be nullptr) ended with @events events, its threshold was @thresh
+	void learn(Baseline* cgroup, uint64_t events, unsigned thresh);
+	// Returns the threshold for the next window of a cgroup. @previous is the threshold of its last window, or the
+	// configured one if there was none.
+	unsigned threshold(Baseline const* cgroup, unsigned root, unsigned previous) const;
+
+	// Write the state file if something has changed since the last save. Does nothing without a state file.
+	void saveIfChanged();
+	void save();
+};
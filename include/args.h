@@ -1,5 +1,17 @@
 #pragma once
 #include <string.h>
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+// A cgroup subtree to watch and the policy for every cgroup in it
+struct WatchRoot {
+	std::string path; // absolute, without trailing slash. The last component may be a glob pattern.
+	float window_seconds;
+	unsigned event_thresh;
+
+	bool is_pattern() const;
+};
 
 class Args {
 public:
@@ -7,6 +19,15 @@ public:
 	std::string slice_path = "/user.slice/";
 	float window_seconds = 10.0;
 	unsigned event_thresh = 50;
+	float cooldown_seconds = 5.0;
+	bool adaptive = false;
+	std::string adaptive_state = "";
+	std::string snapshot_file = "";
+	uint64_t snapshot_size = 4 << 20;
+	std::string dump_snapshots = "";
+	bool io_uring = false;
+	std::vector<WatchRoot> roots;        // defaults to just slice_path
+	std::vector<std::string> excludes;   // absolute, defaults to just user-0.slice
 
 	Args(int argc, char** argv);
 };
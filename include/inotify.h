@@ -1,5 +1,6 @@
 #pragma once
 #include <assert.h>
+#include <poll.h>
 
 #include <functional>
 #include <optional>
@@ -7,6 +8,8 @@
 #include <cinttypes>
 #include <unordered_map>
 
+class IoUring;
+
 struct InotifyError {
 	int e;
 	std::string msg;
@@ -29,28 +32,64 @@ class Inotify final {
 	std::unordered_map<int, std::string> by_watches;
 	std::unordered_map<std::string, int> by_paths;
 	std::vector<std::function<void(int, const std::string&)>> removal_listener;
+	std::vector<std::function<void()>> idle_listener;
+	std::vector<std::pair<int, std::function<void()>>> fd_listener;
+	std::vector<struct pollfd> poll_fds;
+	IoUring* ring = nullptr;
+	int newest_watch = -1;
+	unsigned reads_since_poll = 0;
+
+	// With io_uring, the read of events and the polls of the fd listeners stay in flight until they complete
+	bool read_in_flight = false;
+	std::optional<ssize_t> read_result;
+	std::vector<bool> polls_in_flight, polls_ready; // per fd listener
 
 	__attribute__((aligned(4))) char buffer[1024];
 	size_t buffer_next_event_idx = 0, buffer_filled_to_idx = 0;
 
 	void notify_all_removal_listeners(int wd, const std::string& path);
+	std::optional<struct InotifyEvent> nextEvent(bool block);
+	std::optional<ssize_t> readWithRing(bool block);
+	void cancelWithRing();
+	struct io_uring_sqe* getSqe();
+	bool pollListeners(bool block);
 
 public:
-	Inotify();
+	// If @ring is given, events are read through it instead of with read(2).
+	Inotify(IoUring* ring = nullptr);
 	~Inotify();
 
+	// Not movable, operations in flight on the ring refer to it
 	Inotify(Inotify&) = delete;
-	Inotify(Inotify&&);
 	Inotify& operator=(Inotify&) = delete;
-	Inotify& operator=(Inotify&&);
+
+	static constexpr unsigned listener_poll_every = 64;
 
 	int addWatch(std::string path, int events_mask, int path_relative_to_watch = -1);
 	void removeWatch(std::string const& path);
 	void removeWatch(int watch);
+	// Returns the watch for @path, if it is watched.
+	std::optional<int> findWatch(std::string const& path) const;
+	// Returns the highest watch handed out so far, or -1. The kernel hands out watches in increasing order, so every
+	// watch added later is higher.
+	int newestWatch() const;
 
 	// append a handler. This handler will be invoked whenever a file is not listened to anymore.
 	// This function will be called with the file's watch-descriptor and filename as its arguments.
 	void addFileRemovalListener(std::function<void(int, const std::string&)>&& listener);
 
+	// append a handler. This handler will be invoked whenever all events that have been read so far are handled,
+	// right before blocking for new ones. Use it to flush work that has been batched up while handling events.
+	void addIdleListener(std::function<void()>&& listener);
+
+	// append a handler. While waiting for events, @fd is polled as well and this handler is invoked whenever it is
+	// readable. The handler has to consume whatever made @fd readable.
+	// Without io_uring, @fd is only polled every listener_poll_every reads as long as events keep coming.
+	void addFdListener(int fd, std::function<void()>&& listener);
+
 	struct InotifyEvent readEvent();
+	// Like readEvent(), but also returns an empty optional after an fd listener has been invoked.
+	std::optional<struct InotifyEvent> waitEvent();
+	// Like readEvent(), but returns an empty optional instead of blocking if there is no event.
+	std::optional<struct InotifyEvent> pollEvent();
 };
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class IoUring;
+class Snapshotter;
+
+// Collects the cgroups that should be killed while handling a batch of inotify events and kills them all at once.
+//
+// With io_uring, all files of all cgroups in the batch are opened with one submission. A second submission then
+// writes cgroup.kill of every cgroup, each linked to the reads of its pids.* files, so the kill always comes first and
+// the diagnostics are only gathered afterwards. Without io_uring, the same steps are done with one system call each.
+class KillBatch final {
+	IoUring* ring;
+	Snapshotter* snapshotter;
+	std::vector<std::string> pending; // cgroup directories, with trailing slash
+	std::vector<std::string> failed;  // the cgroups of the last flush that could not be killed
+
+	struct Slot;
+	std::vector<Slot> slots; // preallocated state for the io_uring path
+
+	void flush_with_syscalls();
+	void flush_with_ring(size_t begin, size_t end);
+
+public:
+	// Both @ring and @snapshotter are optional. Cgroups that are snapshotted are killed by the Snapshotter instead.
+	KillBatch(IoUring* ring, Snapshotter* snapshotter);
+	~KillBatch();
+
+	KillBatch(KillBatch&) = delete;
+	KillBatch& operator=(KillBatch&) = delete;
+
+	// How many cgroups the io_uring path handles with one pair of submissions, fewer if the ring is too small for them
+	static constexpr size_t max_ring_batch = 16;
+
+	void add(std::string cgroup_dir);
+	bool empty() const {
+		return pending.empty();
+	}
+	// Returns the cgroups that could not be killed. Cgroups that are frozen for a snapshot count as killed, their kill
+	// is delivered by the Snapshotter later on.
+	std::vector<std::string> const& flush();
+};
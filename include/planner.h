@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "inotify.h"
+#include "kill.h"
+
+// Decides which cgroups are actually killed, so that a storm of triggers does not turn into a storm of kills.
+//
+// Every cgroup goes through armed -> draining -> cooldown -> armed. Only armed cgroups are killed, triggers for a
+// cgroup in any other state are dropped, as are triggers for its descendants that already existed when it was killed.
+// A killed cgroup drains until cgroup.events reports "populated 0" or the cgroup is removed, then it stays in cooldown
+// for a while. A cgroup whose kill fails stays armed, so the next trigger tries again. Cgroups that are removed are
+// forgotten right away.
+//
+// All triggers between two flushes form one batch. If every populated child of a cgroup has triggered and the cgroup
+// has no processes of its own, the parent is killed instead: it hits the same processes with one write and only one
+// teardown has to be tracked.
+class KillPlanner final {
+public:
+	enum class State { ARMED, DRAINING, COOLDOWN };
+
+	// If a killed cgroup is still populated after this time, it is armed again.
+	static constexpr std::chrono::seconds drain_timeout{30};
+	// How often entries whose time is up are removed, even if nothing triggers for them again.
+	static constexpr std::chrono::seconds sweep_interval{10};
+
+private:
+	struct Entry {
+		State state;
+		std::chrono::time_point<std::chrono::steady_clock> since;
+		int events_watch = -1;
+		int newest_watch; // descendants watched later than this were created after the kill and are not covered by it
+		unsigned suppressed = 0;
+	};
+
+	Inotify& inotify;
+	KillBatch& kills;
+	std::chrono::duration<float> cooldown;
+	std::function<bool(std::string const&)> may_kill;
+
+	std::unordered_map<std::string, Entry> cgroups; // cgroup directory (with trailing slash) -> entry, if not armed
+	std::unordered_map<int, std::string> by_events_watch;
+	std::vector<std::string> triggered;
+	std::chrono::time_point<std::chrono::steady_clock> last_sweep;
+
+	bool isExpired(Entry const& entry, std::chrono::time_point<std::chrono::steady_clock> now) const;
+	void expire(std::string const& cgroup_dir);
+	void sweep();
+	Entry* activeEntryFor(std::string const& cgroup_dir, int watch);
+	void mergeSiblings(std::vector<std::string>& victims);
+	void startDraining(std::string const& cgroup_dir, int newest_watch);
+	void finishDraining(std::string const& cgroup_dir, Entry& entry);
+
+public:
+	// @may_kill tells whether a cgroup that did not trigger by itself may be killed in place of its children. It is only
+	// asked for cgroups without processes of their own.
+	KillPlanner(Inotify& inotify, KillBatch& kills, float cooldown_seconds,
+				std::function<bool(std::string const&)>&& may_kill);
+
+	KillPlanner(KillPlanner&) = delete;
+	KillPlanner& operator=(KillPlanner&) = delete;
+
+	// The cgroup in directory @cgroup_dir (with trailing slash) should be killed. @watch is the watch that noticed it.
+	void trigger(std::string cgroup_dir, int watch);
+	// Kill everything that has been triggered since the last flush.
+	void flush();
+
+	// Returns true if @e belongs to a cgroup.events file watched by this planner.
+	bool handleEvent(InotifyEvent const& e);
+	// To be called whenever a watch is removed.
+	void forgetWatch(int watch);
+};
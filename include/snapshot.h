@@ -0,0 +1,150 @@
+#pragma once
+
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct SnapshotError {
+	int e;
+	std::string msg;
+	__attribute__((noreturn)) void bail() const;
+};
+
+// On-disk layout of the snapshot ring buffer:
+// A FileHeader followed by `capacity` bytes of record area. Every record starts 8-byte aligned with a RecordHeader and
+// is followed by `n_sections` sections, each consisting of a SectionHeader and its (8-byte padded) payload.
+// Records are never split. If a record does not fit into the rest of the record area, a wrap marker is written and
+// the record is placed at the start of the record area, overwriting the oldest records.
+// The intact records are the ones from `tail` to `head`. Readers walk them by their length, wrapping at a wrap marker
+// or if less than 8 bytes are left. They never scan for record headers: the payload of a record comes from the
+// captured processes and may contain anything, including what looks like a record.
+// All integers are stored in host byte order.
+namespace snapshot {
+
+constexpr char file_magic[8] = {'F', 'B', 'K', 'S', 'N', 'A', 'P', '1'};
+constexpr uint32_t file_version = 2;
+constexpr uint32_t record_magic = 0x52534246; // "FBSR"
+constexpr uint32_t wrap_magic = 0x57534246;   // "FBSW"
+
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t capacity;
+	uint64_t head;     // offset (relative to the record area) at which the next record will be written
+	uint64_t next_seq; // sequence number of the next record
+	uint64_t tail;     // offset of the oldest record
+	uint64_t tail_seq; // sequence number of the oldest record, equal to next_seq if there are no records
+};
+
+enum RecordFlags : uint32_t {
+	FROZEN_DURING_CAPTURE = 1 << 0, // cgroup.events reported the cgroup as frozen, the process list is complete
+	KILLED_BEFORE_CAPTURE = 1 << 1, // freezing was not possible, data was captured after the kill
+	KILL_FAILED = 1 << 2,
+	TRUNCATED = 1 << 3, // not all processes or files fit into the record
+};
+
+struct RecordHeader {
+	uint32_t magic;
+	uint32_t length; // including this header, multiple of 8
+	uint64_t seq;
+	int64_t realtime_ns;     // CLOCK_REALTIME at the time of the trigger
+	uint64_t capture_ns;     // time it took to capture the data
+	uint32_t flags;          // RecordFlags
+	uint32_t n_sections;
+};
+
+enum SectionType : uint16_t {
+	CGROUP_PATH = 1,
+	PIDS_CURRENT,
+	PIDS_PEAK,
+	PIDS_MAX,
+	PIDS_EVENTS,
+	CPU_STAT,
+	MEMORY_CURRENT,
+	PROCESS, // a ProcessEntry, followed by comm and cmdline
+};
+
+struct SectionHeader {
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t length; // length of the payload, without padding
+};
+
+struct ProcessEntry {
+	int32_t pid;
+	int32_t ppid;
+	uint16_t comm_len;
+	uint16_t cmdline_len; // arguments are separated by '\0'
+};
+
+} // namespace snapshot
+
+// Captures forensic data about cgroups that are being killed into a bounded ring buffer on disk.
+//
+// The event loop only freezes the cgroup and opens the files that need to be read; reading them, killing the cgroup and
+// writing the record happens on a separate worker thread. The worker takes all queued cgroups at once and kills each
+// of them right after capturing it; the records are only written and synced once the whole batch is dead.
+// If the cgroup cannot be frozen (e.g. on old kernels or if the worker queue is full), the cgroup is killed right away
+// and whatever is left is captured afterwards.
+// Frozen cgroups must never outlive the daemon: the destructor captures and kills everything that is still queued, and
+// if the process exits without running it, kill_pending() is run from an atexit handler.
+class Snapshotter final {
+	struct Job;
+
+	int file_fd = -1;
+	snapshot::FileHeader header;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Job*> queue;
+	std::vector<Job*> batch; // the jobs the worker has taken from the queue
+	size_t n_captured = 0;   // how many jobs of the batch have been captured (and killed) already
+	bool stopping = false;
+	std::thread worker;
+
+	// preallocated buffers, only touched by the worker thread
+	std::vector<char> record;  // the record that is being captured
+	std::vector<char> records; // the records of the batch that have not been written yet
+	std::vector<char> read_buffer;
+	std::vector<int32_t> pids;
+
+	void run();
+	void capture(Job& job);
+	void persist();
+	void drop_oldest();
+	size_t append_section(size_t offset, uint16_t type, const char* data, size_t len);
+	size_t append_file(size_t offset, uint16_t type, int fd);
+	size_t append_process(size_t offset, int32_t pid);
+	void collect_pids(int dir_fd, int procs_fd, unsigned depth);
+
+public:
+	static constexpr size_t max_record_size = 64 * 1024;
+	static constexpr size_t max_processes = 512;
+	static constexpr size_t max_queued_jobs = 16;
+	// Freezing is asynchronous. If a cgroup takes longer to freeze, it is captured anyway, but not marked as frozen.
+	static constexpr std::chrono::milliseconds freeze_timeout{100};
+
+	// May throw SnapshotError.
+	Snapshotter(std::string const& path, uint64_t capacity);
+	~Snapshotter();
+
+	Snapshotter(Snapshotter&) = delete;
+	Snapshotter& operator=(Snapshotter&) = delete;
+
+	// Kill the cgroup in directory @cgroup_dir (with trailing slash) and record a snapshot of it.
+	// Returns false if the kill could not even be attempted.
+	bool kill_and_capture(std::string const& cgroup_dir);
+	// Kill and thaw every cgroup that is still waiting to be captured. Their snapshots are taken after the kill.
+	// May be called from any thread.
+	void kill_pending();
+
+	// Print all records from the snapshot file at @path, oldest first. May throw SnapshotError.
+	static void dump(std::string const& path, std::ostream& out);
+};
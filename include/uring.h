@@ -0,0 +1,65 @@
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include <functional>
+#include <memory>
+
+// Minimal io_uring wrapper on top of the raw system calls.
+//
+// The ring is only ever used synchronously from one thread: a user grabs some SQEs, submits them and waits for all of
+// their completions before anybody else touches the ring. The only exception are persistent operations, which may stay
+// in flight across submissions (e.g. the read of inotify events that waits for the next event).
+class IoUring final {
+	int ring_fd = -1;
+	unsigned sq_entries = 0;
+
+	void* sq_ptr = nullptr;
+	size_t sq_size = 0;
+	void* cq_ptr = nullptr;
+	size_t cq_size = 0;
+	struct io_uring_sqe* sqes = nullptr;
+	size_t sqes_size = 0;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe* cqes;
+
+	unsigned local_tail = 0; // our copy of the SQ tail, includes SQEs that have been handed out but not submitted yet
+	unsigned to_submit = 0;
+
+	std::function<void(const struct io_uring_cqe&)> persistent_handler;
+
+	IoUring() = default;
+
+	int submit(unsigned wait_nr);
+	bool pop_cqe(struct io_uring_cqe& cqe);
+	int reap(unsigned n_completions, const std::function<void(const struct io_uring_cqe&)>& handler);
+
+public:
+	// Returns nullptr (and logs why) if io_uring or one of the operations we need is not available.
+	static std::unique_ptr<IoUring> create(unsigned entries);
+	~IoUring();
+
+	IoUring(IoUring&) = delete;
+	IoUring& operator=(IoUring&) = delete;
+
+	// Returns a zeroed SQE or nullptr if the submission queue is full.
+	struct io_uring_sqe* get_sqe();
+	unsigned space_left() const;
+
+	// Operations whose user_data has this bit set are persistent. Their completions are not counted by
+	// submit_and_wait(), they are passed to the handler given to set_persistent_handler() whenever they show up.
+	static constexpr uint64_t persistent = uint64_t{1} << 63;
+	void set_persistent_handler(std::function<void(const struct io_uring_cqe&)>&& handler);
+
+	// Submit all SQEs handed out so far with a single system call (as long as no signal interrupts the wait and the
+	// kernel consumes all of them at once) and call @handler for each of the @n_completions completions they produce.
+	// Returns 0 or -errno if the submission failed. Even then, @handler has been called for the completions of every
+	// SQE that the kernel consumed before the failure.
+	int submit_and_wait(unsigned n_completions, const std::function<void(const struct io_uring_cqe&)>& handler);
+	// Submit all SQEs handed out so far and pass the completions that are available to the persistent handler. Only
+	// persistent operations may be in flight. If @wait is set, waits for at least one completion first.
+	// Returns 0 or -errno.
+	int submit_persistent(bool wait);
+};
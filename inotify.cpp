@@ -1,10 +1,12 @@
 #include "inotify.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <string.h>
 #include <sys/inotify.h>
 
 #include "spdlog/spdlog.h"
+#include "uring.h"
 
 #ifdef USE_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -69,28 +71,44 @@ static void systemd_set_status(size_t i) {
 #endif
 }
 
-Inotify::Inotify() {
-	inotify_fd = inotify_init1(IN_CLOEXEC);
+// user_data of the operations on the ring, all of them are persistent
+enum : uint64_t {
+	OP_READ = 0,
+	OP_CANCEL = 1,
+	OP_POLL = 2, // + index into fd_listener
+};
+
+Inotify::Inotify(IoUring* ring) : ring(ring) {
+	inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
 	if (inotify_fd < 0)
 		throw InotifyError{errno, "Could not create inotify filedescriptor"};
+	if (ring) {
+		ring->set_persistent_handler([this](const struct io_uring_cqe& cqe) {
+			uint64_t op = cqe.user_data & ~IoUring::persistent;
+			if (op == OP_READ) {
+				read_in_flight = false;
+				read_result = cqe.res;
+			} else if (op >= OP_POLL) {
+				polls_in_flight[op - OP_POLL] = false;
+				polls_ready[op - OP_POLL] = true;
+			}
+		});
+	}
 }
 
 Inotify::~Inotify() {
+	if (ring) {
+		try {
+			cancelWithRing();
+		} catch (InotifyError e) {
+			spdlog::error("{}: {}", e.msg, e.tostring());
+		}
+	}
 	if (inotify_fd < 0)
 		return;
 	close(inotify_fd);
 }
 
-Inotify::Inotify(Inotify&& other) : inotify_fd(other.inotify_fd) {
-	other.inotify_fd = -1;
-}
-
-Inotify& Inotify::operator=(Inotify&& other) {
-	inotify_fd = other.inotify_fd;
-	other.inotify_fd = -1;
-	return *this;
-}
-
 int Inotify::addWatch(std::string path, int events_mask, int path_relative_to_watch) {
 	if (path_relative_to_watch != -1) {
 		path = by_watches.at(path_relative_to_watch) + "/" + path;
@@ -100,6 +118,7 @@ int Inotify::addWatch(std::string path, int events_mask, int path_relative_to_wa
 		throw InotifyError{errno, "Could not add path \"" + path + "\" to inotify fd"};
 	by_watches.insert({watch, path});
 	by_paths.insert({path, watch});
+	newest_watch = std::max(newest_watch, watch);
 	systemd_set_status(by_paths.size());
 	return watch;
 }
@@ -124,11 +143,29 @@ void Inotify::removeWatch(int watch) {
 	systemd_set_status(by_paths.size());
 }
 
+std::optional<int> Inotify::findWatch(std::string const& path) const {
+	auto it = by_paths.find(path);
+	return it == by_paths.end() ? std::optional<int>{} : it->second;
+}
+
+int Inotify::newestWatch() const {
+	return newest_watch;
+}
 
 void Inotify::addFileRemovalListener(std::function<void(int, const std::string&)>&& listener) {
 	removal_listener.push_back(listener);
 }
 
+void Inotify::addIdleListener(std::function<void()>&& listener) {
+	idle_listener.push_back(listener);
+}
+
+void Inotify::addFdListener(int fd, std::function<void()>&& listener) {
+	fd_listener.emplace_back(fd, listener);
+	polls_in_flight.push_back(false);
+	polls_ready.push_back(false);
+}
+
 void Inotify::notify_all_removal_listeners(int wd, const std::string& path) {
 	for (auto& listener : removal_listener) {
 		listener(wd, path);
@@ -136,10 +173,174 @@ void Inotify::notify_all_removal_listeners(int wd, const std::string& path) {
 }
 
 struct InotifyEvent Inotify::readEvent() {
+	while (true) {
+		if (auto e = nextEvent(true))
+			return std::move(*e);
+	}
+}
+
+std::optional<struct InotifyEvent> Inotify::waitEvent() {
+	return nextEvent(true);
+}
+
+std::optional<struct InotifyEvent> Inotify::pollEvent() {
+	return nextEvent(false);
+}
+
+// Polls the inotify fd together with the fds of the fd listeners and invokes the listeners of the readable fds.
+// Returns false if a listener has been invoked (or the wait has been interrupted), so that the caller gets a chance to
+// react to it before blocking again.
+bool Inotify::pollListeners(bool block) {
+	poll_fds.resize(1 + fd_listener.size());
+	poll_fds[0] = {.fd = inotify_fd, .events = POLLIN, .revents = 0};
+	for (size_t l = 0; l < fd_listener.size(); l++)
+		poll_fds[1 + l] = {.fd = fd_listener[l].first, .events = POLLIN, .revents = 0};
+
+	if (poll(poll_fds.data(), poll_fds.size(), block ? -1 : 0) < 0) {
+		if (errno == EINTR)
+			return false;
+		throw InotifyError{errno, "Could not poll inotify fd"};
+	}
+	bool listener_invoked = false;
+	for (size_t l = 0; l < fd_listener.size(); l++) {
+		if (poll_fds[1 + l].revents) {
+			fd_listener[l].second();
+			listener_invoked = true;
+		}
+	}
+	return !listener_invoked;
+}
+
+// Reads events through the ring. The read is submitted together with the polls of the fd listeners and each of them
+// stays in flight until it completes, so waiting for whichever comes first takes a single system call.
+// Returns the number of bytes read or -1 (and sets errno). Returns an empty optional if an fd listener has been invoked
+// or if @block is not set and there are no events.
+std::optional<ssize_t> Inotify::readWithRing(bool block) {
+	// A read that has just been submitted might not be complete when the submission returns. Only submit it if there
+	// is something to read, so that it can be waited for.
+	if (!block && !read_in_flight && !read_result) {
+		struct pollfd p = {.fd = inotify_fd, .events = POLLIN, .revents = 0};
+		if (poll(&p, 1, 0) < 0 && errno != EINTR)
+			throw InotifyError{errno, "Could not poll inotify fd"};
+		block = p.revents & POLLIN;
+	}
+
+	while (true) {
+		if (block && !read_in_flight && !read_result) {
+			struct io_uring_sqe* sqe = getSqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = inotify_fd;
+			sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+			sqe->len = sizeof(buffer);
+			sqe->user_data = IoUring::persistent | OP_READ;
+			read_in_flight = true;
+		}
+		for (size_t l = 0; l < fd_listener.size(); l++) {
+			if (polls_in_flight[l] || polls_ready[l])
+				continue;
+			struct io_uring_sqe* sqe = getSqe();
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = fd_listener[l].first;
+			sqe->poll32_events = POLLIN;
+			sqe->user_data = IoUring::persistent | (OP_POLL + l);
+			polls_in_flight[l] = true;
+		}
+		bool ready = read_result || std::find(polls_ready.begin(), polls_ready.end(), true) != polls_ready.end();
+		int ret = ring->submit_persistent(block && !ready);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+
+		bool listener_invoked = false;
+		for (size_t l = 0; l < fd_listener.size(); l++) {
+			if (polls_ready[l]) {
+				polls_ready[l] = false;
+				fd_listener[l].second();
+				listener_invoked = true;
+			}
+		}
+		// A completed read is kept for the next call
+		if (listener_invoked)
+			return std::nullopt;
+		if (read_result) {
+			ssize_t n_bytes = *read_result;
+			read_result.reset();
+			if (n_bytes < 0) {
+				errno = -n_bytes;
+				return -1;
+			}
+			return n_bytes;
+		}
+		if (!block)
+			return std::nullopt;
+	}
+}
+
+// Cancel everything that is in flight on the ring and wait until it is gone, the kernel must not write into the buffer
+// anymore.
+void Inotify::cancelWithRing() {
+	auto cancel = [&](uint64_t op) {
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = IoUring::persistent | op;
+		sqe->user_data = IoUring::persistent | OP_CANCEL;
+	};
+	if (read_in_flight)
+		cancel(OP_READ);
+	for (size_t l = 0; l < fd_listener.size(); l++)
+		if (polls_in_flight[l])
+			cancel(OP_POLL + l);
+	// A cancelled operation might complete only after its cancellation
+	auto in_flight = [&]() {
+		return read_in_flight ||
+			   std::find(polls_in_flight.begin(), polls_in_flight.end(), true) != polls_in_flight.end();
+	};
+	while (in_flight() && ring->submit_persistent(true) >= 0)
+		;
+	ring->set_persistent_handler(nullptr);
+}
+
+// Returns an SQE of the ring. If the submission queue is full, what is in it is submitted first.
+struct io_uring_sqe* Inotify::getSqe() {
+	while (true) {
+		if (struct io_uring_sqe* sqe = ring->get_sqe())
+			return sqe;
+		int ret = ring->submit_persistent(false);
+		if (ret < 0)
+			throw InotifyError{-ret, "Could not submit to io_uring"};
+	}
+}
+
+std::optional<struct InotifyEvent> Inotify::nextEvent(bool block) {
 	while (true) {
 		if (buffer_filled_to_idx == buffer_next_event_idx) {
 			buffer_filled_to_idx = buffer_next_event_idx = 0;
-			ssize_t n_bytes = read(inotify_fd, buffer, sizeof(buffer));
+			for (auto& listener : idle_listener)
+				listener();
+
+			ssize_t n_bytes;
+			if (ring) {
+				auto result = readWithRing(block);
+				if (!result)
+					return std::nullopt;
+				n_bytes = *result;
+			} else {
+				// The fd listeners are only polled when there is nothing to read. A storm of events must not hide them
+				// for too long though, e.g. a shutdown.
+				if (!fd_listener.empty() && ++reads_since_poll >= listener_poll_every) {
+					reads_since_poll = 0;
+					if (!pollListeners(false))
+						return std::nullopt;
+				}
+				n_bytes = read(inotify_fd, buffer, sizeof(buffer));
+				while (n_bytes < 0 && errno == EAGAIN) {
+					if (!block || !pollListeners(true))
+						return std::nullopt;
+					reads_since_poll = 0;
+					n_bytes = read(inotify_fd, buffer, sizeof(buffer));
+				}
+			}
 			if (n_bytes < 0) {
 				buffer_filled_to_idx = 0;
 				throw InotifyError{errno, "Could not read event from inotify fd"};
@@ -165,6 +366,10 @@ struct InotifyEvent Inotify::readEvent() {
 			.path_of_watch = by_watches.contains(event_ptr->wd) ? by_watches[event_ptr->wd] : "",
 		};
 
+		// Not bound to any watch, the caller has to find out what it missed
+		if (new_event.event_mask & IN_Q_OVERFLOW)
+			return new_event;
+
 		if (!by_watches.contains(new_event.watch)) {
 			spdlog::log(
 #ifdef MORE_EFFORT_REMOVAL
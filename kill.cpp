@@ -0,0 +1,256 @@
+#include "kill.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "spdlog/spdlog.h"
+#include "uring.h"
+
+static constexpr const char* stat_files[] = {"pids.current", "pids.peak", "pids.max", "pids.events"};
+static constexpr size_t n_stat_files = sizeof(stat_files) / sizeof(*stat_files);
+static const char kill_data[] = "1\n";
+// Per cgroup, the second submission is the largest: the kill, a read of each stat file and a close of every file
+static constexpr size_t max_sqes_per_cgroup = 1 + n_stat_files + (1 + n_stat_files);
+
+struct KillBatch::Slot {
+	std::string paths[1 + n_stat_files]; // cgroup.kill, then the stat files
+	int fds[1 + n_stat_files];
+	bool closed[1 + n_stat_files];
+	int kill_res;
+	int read_res[n_stat_files];
+	char buffers[n_stat_files][64];
+};
+
+KillBatch::KillBatch(IoUring* ring, Snapshotter* snapshotter)
+	: ring(ring), snapshotter(snapshotter), slots(ring ? max_ring_batch : 0) {}
+
+KillBatch::~KillBatch() = default;
+
+void KillBatch::add(std::string cgroup_dir) {
+	if (std::find(pending.begin(), pending.end(), cgroup_dir) != pending.end())
+		return;
+	pending.push_back(std::move(cgroup_dir));
+}
+
+std::vector<std::string> const& KillBatch::flush() {
+	failed.clear();
+	if (pending.empty())
+		return failed;
+	if (snapshotter) {
+		for (auto& path : pending) {
+			spdlog::info("Killing cgroup \"{}\"...", path);
+			if (!snapshotter->kill_and_capture(path))
+				failed.push_back(path);
+		}
+	} else if (ring) {
+		// Each submission has to fit into the submission queue
+		size_t batch = std::min<size_t>(max_ring_batch, ring->space_left() / max_sqes_per_cgroup);
+		if (!batch)
+			flush_with_syscalls();
+		for (size_t begin = 0; batch && begin < pending.size(); begin += batch)
+			flush_with_ring(begin, std::min(begin + batch, pending.size()));
+	} else {
+		flush_with_syscalls();
+	}
+	pending.clear();
+	return failed;
+}
+
+static std::string read_file(const std::string& path) {
+	std::ifstream ifs(path);
+
+	// https://stackoverflow.com/a/2912614
+	std::string content((std::istreambuf_iterator<char>(ifs)), (std::istreambuf_iterator<char>()));
+
+	content.erase(std::remove(content.begin(), content.end(), '\n'), content.cend());
+	return content;
+}
+
+void KillBatch::flush_with_syscalls() {
+	for (auto& dir : pending) {
+		spdlog::info("Killing cgroup \"{}\"...", dir);
+		std::string path = dir + "cgroup.kill";
+
+		int fd = open(path.c_str(), O_WRONLY);
+		if (fd < 0) {
+			spdlog::error("Could not kill: open \"{}\" as write-only failed: {}", path, strerror(errno));
+			failed.push_back(dir);
+			continue;
+		}
+		const size_t len = strlen(kill_data);
+		ssize_t n_bytes = write(fd, kill_data, len);
+		close(fd);
+		if (n_bytes < 0) {
+			spdlog::error("Could not kill: writing \"1\\n\" into cgroup.kill failed: {}", strerror(errno));
+			failed.push_back(dir);
+			continue;
+		}
+		if (static_cast<size_t>(n_bytes) < len) {
+			spdlog::error("Could not kill: writing 2 bytes into cgroup.kill resulted in only {} bytes written?",
+						  n_bytes);
+			failed.push_back(dir);
+			continue;
+		}
+
+		try {
+			spdlog::info("pids.current = {}, pids.peak = {}, pids.max = {}, pids.events = {}",
+						 read_file(dir + "pids.current"), read_file(dir + "pids.peak"), read_file(dir + "pids.max"),
+						 read_file(dir + "pids.events"));
+		} catch (std::exception& e) {
+			spdlog::error("Could not log additional parameters about cgroup being killed: {}", e.what());
+		}
+	}
+}
+
+// user_data layout of the SQEs: slot index in the upper bits, the operation in the lowest 4 bits
+enum : uint64_t {
+	OP_KILL = 0,
+	OP_READ = 1, // + index into stat_files
+	OP_CLOSE = 8, // + index into fds
+	OP_BITS = 4,
+};
+
+// flush() only passes as many cgroups as the submission queue has room for, so get_sqe() never fails here
+void KillBatch::flush_with_ring(size_t begin, size_t end) {
+	// First submission: open cgroup.kill and the stat files of every cgroup
+	unsigned n_sqes = 0;
+	for (size_t s = 0; s < end - begin; s++) {
+		Slot& slot = slots[s];
+		std::fill(std::begin(slot.fds), std::end(slot.fds), -EBADF);
+		slot.paths[0] = pending[begin + s] + "cgroup.kill";
+		for (size_t f = 0; f < n_stat_files; f++)
+			slot.paths[1 + f] = pending[begin + s] + stat_files[f];
+		for (size_t f = 0; f < 1 + n_stat_files; f++) {
+			struct io_uring_sqe* sqe = ring->get_sqe();
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<uintptr_t>(slot.paths[f].c_str());
+			sqe->open_flags = (f == 0 ? O_WRONLY : O_RDONLY) | O_CLOEXEC;
+			sqe->user_data = s << OP_BITS | f;
+			n_sqes++;
+		}
+	}
+	int ret = ring->submit_and_wait(n_sqes, [&](const struct io_uring_cqe& cqe) {
+		slots[cqe.user_data >> OP_BITS].fds[cqe.user_data & ((1 << OP_BITS) - 1)] = cqe.res;
+	});
+	if (ret < 0) {
+		spdlog::error("Submitting to io_uring failed ({}), falling back to plain system calls", strerror(-ret));
+		// Some files might have been opened before the submission failed
+		for (size_t s = 0; s < end - begin; s++)
+			for (int fd : slots[s].fds)
+				if (fd >= 0)
+					close(fd);
+		std::vector<std::string> rest(pending.begin() + begin, pending.begin() + end);
+		std::swap(rest, pending);
+		flush_with_syscalls();
+		std::swap(rest, pending);
+		return;
+	}
+
+	// Second submission: per cgroup, a chain of kill -> reads -> closes. Hard links keep the order even if one
+	// operation fails, e.g. the stat files can still be read if the kill failed.
+	n_sqes = 0;
+	for (size_t s = 0; s < end - begin; s++) {
+		Slot& slot = slots[s];
+		slot.kill_res = slot.fds[0];
+		std::fill(std::begin(slot.closed), std::end(slot.closed), false);
+		std::fill(std::begin(slot.read_res), std::end(slot.read_res), -EBADF);
+
+		struct io_uring_sqe* last = nullptr;
+		auto next_sqe = [&](uint64_t op) {
+			if (last)
+				last->flags |= IOSQE_IO_HARDLINK;
+			last = ring->get_sqe();
+			last->user_data = s << OP_BITS | op;
+			n_sqes++;
+			return last;
+		};
+		if (slot.fds[0] >= 0) {
+			struct io_uring_sqe* sqe = next_sqe(OP_KILL);
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = slot.fds[0];
+			sqe->addr = reinterpret_cast<uintptr_t>(kill_data);
+			sqe->len = strlen(kill_data);
+		}
+		for (size_t f = 0; f < n_stat_files; f++) {
+			if (slot.fds[1 + f] < 0) {
+				slot.read_res[f] = slot.fds[1 + f];
+				continue;
+			}
+			struct io_uring_sqe* sqe = next_sqe(OP_READ + f);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = slot.fds[1 + f];
+			sqe->addr = reinterpret_cast<uintptr_t>(slot.buffers[f]);
+			sqe->len = sizeof(slot.buffers[f]);
+		}
+		for (size_t f = 0; f < 1 + n_stat_files; f++) {
+			if (slot.fds[f] < 0)
+				continue;
+			struct io_uring_sqe* sqe = next_sqe(OP_CLOSE + f);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = slot.fds[f];
+		}
+	}
+	ret = ring->submit_and_wait(n_sqes, [&](const struct io_uring_cqe& cqe) {
+		Slot& slot = slots[cqe.user_data >> OP_BITS];
+		uint64_t op = cqe.user_data & ((1 << OP_BITS) - 1);
+		if (op == OP_KILL)
+			slot.kill_res = cqe.res;
+		else if (op >= OP_READ && op < OP_READ + n_stat_files)
+			slot.read_res[op - OP_READ] = cqe.res;
+		else if (op >= OP_CLOSE && cqe.res != -ECANCELED)
+			slot.closed[op - OP_CLOSE] = true;
+	});
+	if (ret < 0) {
+		spdlog::error("Submitting to io_uring failed ({}), falling back to plain system calls", strerror(-ret));
+		// Only close what the ring has not closed already, the fd might have been reused in the meantime
+		for (size_t s = 0; s < end - begin; s++)
+			for (size_t f = 0; f < 1 + n_stat_files; f++)
+				if (slots[s].fds[f] >= 0 && !slots[s].closed[f])
+					close(slots[s].fds[f]);
+		std::vector<std::string> rest(pending.begin() + begin, pending.begin() + end);
+		std::swap(rest, pending);
+		flush_with_syscalls();
+		std::swap(rest, pending);
+		return;
+	}
+
+	for (size_t s = 0; s < end - begin; s++) {
+		Slot& slot = slots[s];
+		spdlog::info("Killing cgroup \"{}\"...", pending[begin + s]);
+		if (slot.fds[0] < 0) {
+			spdlog::error("Could not kill: open \"{}\" as write-only failed: {}", slot.paths[0], strerror(-slot.fds[0]));
+			failed.push_back(pending[begin + s]);
+			continue;
+		}
+		if (slot.kill_res < 0) {
+			spdlog::error("Could not kill: writing \"1\\n\" into cgroup.kill failed: {}", strerror(-slot.kill_res));
+			failed.push_back(pending[begin + s]);
+			continue;
+		}
+		if (static_cast<size_t>(slot.kill_res) < strlen(kill_data)) {
+			spdlog::error("Could not kill: writing 2 bytes into cgroup.kill resulted in only {} bytes written?",
+						  slot.kill_res);
+			failed.push_back(pending[begin + s]);
+			continue;
+		}
+
+		std::string values[n_stat_files];
+		for (size_t f = 0; f < n_stat_files; f++) {
+			if (slot.read_res[f] < 0) {
+				values[f] = spdlog::fmt_lib::format("<{}>", strerror(-slot.read_res[f]));
+				continue;
+			}
+			values[f].assign(slot.buffers[f], slot.read_res[f]);
+			values[f].erase(std::remove(values[f].begin(), values[f].end(), '\n'), values[f].cend());
+		}
+		spdlog::info("pids.current = {}, pids.peak = {}, pids.max = {}, pids.events = {}", values[0], values[1],
+					 values[2], values[3]);
+	}
+}
@@ -13,7 +13,7 @@ std::optional<std::string> set_logger(std::string s) {
 	if (s.starts_with("systemd")) {
 		if (!is_systemd) {
 			is_systemd = true;
-			auto systemd_sink = std::make_shared<spdlog::sinks::systemd_sink_st>();
+			auto systemd_sink = std::make_shared<spdlog::sinks::systemd_sink_mt>();
 			spdlog::logger logger{"forkbomb-killer", systemd_sink};
 			spdlog::set_default_logger(std::make_shared<spdlog::logger>(logger));
 		}
@@ -1,22 +1,30 @@
 #include <algorithm>
 #include <chrono>
-#include <fcntl.h>
 #include <filesystem>
-#include <fstream>
+#include <fnmatch.h>
+#include <functional>
 #include <iostream>
-#include <istream>
-#include <iterator>
 #include <memory>
+#include <signal.h>
+#include <string.h>
 #include <string>
 #include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <system_error>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
+#include "adaptive.h"
 #include "args.h"
 #include "inotify.h"
+#include "kill.h"
 #include "log.h"
+#include "planner.h"
+#include "snapshot.h"
 #include "spdlog/spdlog.h"
+#include "uring.h"
 
 #ifdef USE_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -36,18 +44,47 @@ static bool is_inside_dir(std::filesystem::path higher, std::filesystem::path lo
 	lower = lower.lexically_normal();
 	higher = higher.lexically_normal();
 
-	auto [higher_end, _nothing] = std::mismatch(higher.begin(), higher.end(), lower.begin());
+	auto [higher_end, _nothing] = std::mismatch(higher.begin(), higher.end(), lower.begin(), lower.end());
 
 	return higher_end == higher.end();
 }
 
-/// Add all directories in this @path (and files matching @filename_to_listen_to) to this Inotify,
-/// except if it matches any path in the @excludes vector.
+static constexpr int dir_events_mask =
+	IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+/// All watches of all roots share one Inotify. This keeps track of which root (and thereby which policy) each watch
+/// belongs to.
+struct WatchTable {
+	std::vector<WatchRoot> roots;
+	std::vector<std::filesystem::path> excludes;
+	std::unordered_map<int, unsigned> root_of;                       // watch -> index into roots
+
+	/// Handles the events that are pending. Called every @drain_every new watches while walking a tree, so that the
+	/// cgroups that are watched already stay protected while a large tree is walked.
+	std::function<void()> drain;
+	unsigned watches_since_drain = 0;
+	static constexpr unsigned drain_every = 256;
+	/// Events have been lost (inotify queue overflow), all roots have to be walked again
+	bool rescan = false;
+
+	/// Returns the index of the root @dir is itself (or matches), or -1. If several roots match, the first one wins.
+	int root_at(std::filesystem::path const& dir) const {
+		for (unsigned r = 0; r < roots.size(); r++) {
+			if (roots[r].is_pattern() ? fnmatch(roots[r].path.c_str(), dir.c_str(), FNM_PATHNAME) == 0
+									  : roots[r].path == dir.native())
+				return r;
+		}
+		return -1;
+	}
+};
+
+/// Add all directories in this @path (and files matching @filename_to_listen_to) to this Inotify as part of @root,
+/// except if it matches any path in the excludes of @table. Subdirectories that are roots themselves are left to them.
 ///
 /// May throw InotifyError.
-void addAllRecursively(Inotify& i, std::filesystem::path const& path, std::string const& filename_to_listen_to,
-					   std::vector<std::filesystem::path> excludes = {}) {
-	for (auto& ex_path : excludes)
+void addAllRecursively(Inotify& i, WatchTable& table, std::filesystem::path const& path, unsigned root,
+					   std::string const& filename_to_listen_to) {
+	for (auto& ex_path : table.excludes)
 		if (is_inside_dir(ex_path, path))
 			return;
 
@@ -55,21 +92,31 @@ void addAllRecursively(Inotify& i, std::filesystem::path const& path, std::strin
 	// in which a subdirectory is created while we walk the tree.
 	// Entries that are created during the walk will produce an inotify event. They might then also be
 	// listed during the walk, but that's fine, Linux will just hand out the same watch descriptor as before.
-	int w = i.addWatch(path, IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF);
-	spdlog::trace("Adding dir {} (watch={})", path.string(), w);
+	int w = i.addWatch(path, dir_events_mask);
+	table.root_of[w] = root;
+	spdlog::trace("Adding dir {} (watch={}, root={})", path.string(), w, root);
+	if (++table.watches_since_drain >= WatchTable::drain_every && table.drain) {
+		table.watches_since_drain = 0;
+		table.drain();
+	}
 
 	std::error_code e{};
 	for (auto const& dir_entry :
 		 std::filesystem::directory_iterator{path, std::filesystem::directory_options::skip_permission_denied, e}) {
 		auto p = dir_entry.path();
 		try {
-			if (dir_entry.is_directory())
-				addAllRecursively(i, path / p, filename_to_listen_to, excludes);
-			else if (dir_entry.is_regular_file() && p.filename().string() == filename_to_listen_to) {
-				for (auto& ex_path : excludes)
+			if (dir_entry.is_directory()) {
+				int other = table.root_at(p);
+				if (other >= 0 && static_cast<unsigned>(other) != root) {
+					spdlog::trace("Leaving dir {} to root {}", p.string(), other);
+					continue;
+				}
+				addAllRecursively(i, table, path / p, root, filename_to_listen_to);
+			} else if (dir_entry.is_regular_file() && p.filename().string() == filename_to_listen_to) {
+				for (auto& ex_path : table.excludes)
 					if (is_inside_dir(ex_path, path / p))
 						return;
-				i.addWatch(p.string(), IN_MODIFY);
+				table.root_of[i.addWatch(p.string(), IN_MODIFY)] = root;
 			}
 		} catch (InotifyError e) {
 			if (e.e != ENOENT)
@@ -86,67 +133,98 @@ void addAllRecursively(Inotify& i, std::filesystem::path const& path, std::strin
 	}
 }
 
-static std::string read_file(const std::string &path) {
-	std::ifstream ifs(path);
-
-	// https://stackoverflow.com/a/2912614
-	std::string content((std::istreambuf_iterator<char>(ifs)), (std::istreambuf_iterator<char>()));
+/// Start watching the root with index @root in @table.
+/// For pattern roots and roots that do not exist yet (e.g. machine.slice before the first VM is started), the parent
+/// directory is watched as well, so that they are picked up when created.
+///
+/// May throw InotifyError.
+void registerRoot(Inotify& i, WatchTable& table, unsigned root, std::string const& filename_to_listen_to) {
+	const WatchRoot& r = table.roots[root];
+	spdlog::info("Watching \"{}\" (window {}s, threshold {})", r.path, r.window_seconds, r.event_thresh);
+	if (!r.is_pattern()) {
+		std::error_code ec;
+		if (std::filesystem::is_directory(r.path, ec)) {
+			addAllRecursively(i, table, r.path, root, filename_to_listen_to);
+			return;
+		}
+		std::filesystem::path parent = std::filesystem::path(r.path).parent_path();
+		if (!std::filesystem::is_directory(parent, ec)) {
+			spdlog::warn("Neither \"{}\" nor its parent exist, not watching it", r.path);
+			return;
+		}
+		// The root is matched in deal_with_event() when it is created
+		spdlog::info("\"{}\" does not exist yet, watching it once it is created", r.path);
+		i.addWatch(parent, dir_events_mask);
+		// It might have been created before the watch was added
+		if (std::filesystem::is_directory(r.path, ec))
+			addAllRecursively(i, table, r.path, root, filename_to_listen_to);
+		return;
+	}
 
-	content.erase(std::remove(content.begin(), content.end(), '\n'), content.cend());
-	return content;
+	std::filesystem::path parent = std::filesystem::path(r.path).parent_path();
+	std::error_code ec;
+	if (!std::filesystem::is_directory(parent, ec)) {
+		spdlog::warn("\"{}\" does not exist, not watching \"{}\"", parent.string(), r.path);
+		return;
+	}
+	// Cgroups created in it are matched against the patterns in deal_with_event()
+	i.addWatch(parent, dir_events_mask);
+	std::error_code e{};
+	for (auto const& dir_entry :
+		 std::filesystem::directory_iterator{parent, std::filesystem::directory_options::skip_permission_denied, e}) {
+		try {
+			if (dir_entry.is_directory() && table.root_at(dir_entry.path()) == static_cast<int>(root))
+				addAllRecursively(i, table, dir_entry.path(), root, filename_to_listen_to);
+		} catch (InotifyError e) {
+			if (e.e != ENOENT)
+				throw e;
+			spdlog::trace("-> Could not add, does not exist anymore.");
+		}
+	}
 }
 
-void kill_group_for_pid_event(InotifyEvent&& e) {
+/// The per-watch record of a pids.events file: the current window and, in adaptive mode, what has been learned.
+struct WatchWindow {
+	std::chrono::time_point<std::chrono::steady_clock> start;
+	uint64_t events;
+	unsigned thresh;    // threshold of the current window, fixed when the window starts
+	Baseline* baseline; // statistics of this cgroup, nullptr if not adaptive
+	bool killed;        // the current window lead to a kill
+};
+
+void kill_group_for_pid_event(InotifyEvent&& e, KillPlanner& planner) {
 	assert(e.path_of_watch.ends_with("/" + filename_to_listen_to));
 
 	std::string path = e.path_of_watch.substr(0, e.path_of_watch.length() - filename_to_listen_to.length());
-	spdlog::info("Killing cgroup \"{}\"...", path);
-	try {
-		spdlog::info("pids.current = {}, pids.peak = {}, pids.max = {}, pids.events = {}",
-				read_file(path + "pids.current"),
-				read_file(path + "pids.peak"),
-				read_file(path + "pids.max"),
-				read_file(path + "pids.events"));
-	} catch (std::exception& e) {
-		spdlog::error("Could not log additional parameters about cgroup being killed: {}", e.what());
-	}
-	path = path + "cgroup.kill";
-
-	int fd = open(path.c_str(), O_WRONLY);
-	if (fd < 0) {
-		spdlog::error("Could not kill: open \"{}\" as write-only failed: {}", path, strerror(errno));
-		return;
-	}
-	const char* data = "1\n";
-	const size_t len = strlen(data);
-	ssize_t n_bytes = write(fd, data, len);
-	if (n_bytes < 0) {
-		spdlog::error("Could not kill: writing \"1\\n\" into cgroup.kill failed: {}", strerror(errno));
-		close(fd);
-		return;
-	}
-	if (static_cast<size_t>(n_bytes) < len) {
-		spdlog::error("Could not kill: writing 2 bytes into cgroup.kill resulted in only {} bytes written?", n_bytes);
-		close(fd);
-		return;
-	}
-	close(fd);
-	return;
+	spdlog::trace("Cgroup \"{}\" triggered", path);
+	planner.trigger(std::move(path), e.watch);
 }
 
 void deal_with_event(
-	Inotify& i, const Args& a, InotifyEvent&& e,
-	std::unordered_map<int, std::pair<std::chrono::time_point<std::chrono::steady_clock>, uint64_t>>& pid_events,
+	Inotify& i, WatchTable& table, KillPlanner& planner, AdaptiveThresholds* adaptive, InotifyEvent&& e,
+	std::unordered_map<int, WatchWindow>& pid_events,
 	std::string const& filename_to_listen_to) {
-	if (e.event_mask & IN_CREATE) {
+	if (e.event_mask & IN_Q_OVERFLOW) {
+		// Cgroups might have been created without us noticing
+		spdlog::warn("Inotify queue overflowed, events have been lost. Walking all roots again");
+		table.rescan = true;
+	} else if (e.event_mask & IN_CREATE) {
+		auto root = table.root_of.find(e.watch);
 		try {
-			if (e.event_mask & IN_ISDIR)
-				addAllRecursively(i, e.path_of_watch + "/" + e.path.value(), filename_to_listen_to);
-			else if (!e.path.has_value())
+			if (!e.path.has_value()) {
 				bail("Kernel gave an IN_CREATE event without an path?!?");
-			else if (e.path.value() == filename_to_listen_to) {
+			} else if (e.event_mask & IN_ISDIR) {
+				std::filesystem::path path = e.path_of_watch + "/" + e.path.value();
+				int new_root = table.root_at(path);
+				// In a parent dir of a pattern root, only the matching cgroups are of interest
+				if (new_root >= 0)
+					addAllRecursively(i, table, path, new_root, filename_to_listen_to);
+				else if (root != table.root_of.end())
+					addAllRecursively(i, table, path, root->second, filename_to_listen_to);
+			} else if (e.path.value() == filename_to_listen_to && root != table.root_of.end()) {
 				spdlog::trace("Added path {}", e.path.value());
-				i.addWatch(std::move(e.path.value()), IN_MODIFY, e.watch);
+				unsigned r = root->second;
+				table.root_of[i.addWatch(std::move(e.path.value()), IN_MODIFY, e.watch)] = r;
 			}
 		} catch (InotifyError e) {
 			if (e.e != ENOENT)
@@ -155,28 +233,52 @@ void deal_with_event(
 			spdlog::trace("-> Could not add, does not exist anymore.");
 		}
 	} else if (e.event_mask & IN_MODIFY && e.path_of_watch.ends_with("/" + filename_to_listen_to)) {
+		auto root = table.root_of.find(e.watch);
+		if (root == table.root_of.end()) {
+			spdlog::warn("Got event for watch without a root: {}", e.debug_string());
+			return;
+		}
+		const WatchRoot& a = table.roots[root->second];
 		auto now = std::chrono::steady_clock::now();
-		if (pid_events.contains(e.watch)) {
-			auto& entry = pid_events.at(e.watch);
+		auto it = pid_events.find(e.watch);
+		if (it != pid_events.end()) {
+			auto& entry = it->second;
 			spdlog::trace(
-				"This watch's window started at {:15.9f}s and has had {} events since then",
-				std::chrono::duration_cast<std::chrono::nanoseconds>(entry.first.time_since_epoch()).count() / 1e9,
-				entry.second);
-			if (entry.first < now - std::chrono::duration<float>(a.window_seconds)) {
-				entry.first = now;
-				entry.second = 0;
+				"This watch's window started at {:15.9f}s and has had {} events since then (threshold {})",
+				std::chrono::duration_cast<std::chrono::nanoseconds>(entry.start.time_since_epoch()).count() / 1e9,
+				entry.events, entry.thresh);
+			if (entry.start < now - std::chrono::duration<float>(a.window_seconds)) {
+				// A forkbomb must not become the baseline. learn() also skips windows that came close to the threshold,
+				// e.g. the one before a kill.
+				if (adaptive && !entry.killed) {
+					adaptive->learn(entry.baseline, entry.events, entry.thresh);
+					entry.thresh = adaptive->threshold(entry.baseline, root->second, entry.thresh);
+				}
+				entry.start = now;
+				entry.events = 0;
+				entry.killed = false;
 			} else {
-				entry.second++;
-				if (entry.second >= a.event_thresh) {
-					entry.second = 0;
-					kill_group_for_pid_event(std::move(e));
+				entry.events++;
+				if (entry.events >= entry.thresh) {
+					entry.events = 0;
+					entry.killed = true;
+					kill_group_for_pid_event(std::move(e), planner);
 				}
 			}
 		} else {
 			spdlog::trace("New watch window startging at  {:15.9f}s",
 						  std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count() / 1e9);
-			pid_events.emplace(e.watch, std::make_pair(now, 1));
+			Baseline* baseline = nullptr;
+			unsigned thresh = a.event_thresh;
+			if (adaptive) {
+				baseline = adaptive->baselineFor(
+					e.path_of_watch.substr(0, e.path_of_watch.length() - filename_to_listen_to.length()));
+				thresh = adaptive->threshold(baseline, root->second, a.event_thresh);
+			}
+			pid_events.emplace(e.watch, WatchWindow{now, 1, thresh, baseline, false});
 		}
+	} else if (e.event_mask & IN_MODIFY) {
+		planner.handleEvent(e);
 	}
 }
 
@@ -184,7 +286,38 @@ int main(int argc, char** argv) {
 	setup_logger();
 	Args a{argc, argv};
 
-	std::unordered_map<int, std::pair<std::chrono::time_point<std::chrono::steady_clock>, uint64_t>> pid_events;
+	if (!a.dump_snapshots.empty()) {
+		try {
+			Snapshotter::dump(a.dump_snapshots, std::cout);
+		} catch (SnapshotError e) {
+			e.bail();
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// Blocked before any thread is started, so that they are only ever received through the signalfd in the event loop.
+	// That way, a shutdown always runs the destructors, which kill the cgroups that are frozen for a snapshot.
+	sigset_t shutdown_signals;
+	sigemptyset(&shutdown_signals);
+	sigaddset(&shutdown_signals, SIGTERM);
+	sigaddset(&shutdown_signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+	int signal_fd = signalfd(-1, &shutdown_signals, SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		spdlog::critical("Could not create signalfd: {}", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	std::unique_ptr<Snapshotter> snapshotter;
+	if (!a.snapshot_file.empty()) {
+		try {
+			snapshotter = std::make_unique<Snapshotter>(a.snapshot_file, a.snapshot_size);
+		} catch (SnapshotError e) {
+			e.bail();
+		}
+	}
+
+	std::unordered_map<int, WatchWindow> pid_events;
 
 #ifdef DEBUGGING_CLI
 	std::thread([&pid_events]() {
@@ -212,8 +345,8 @@ int main(int argc, char** argv) {
 					std::cout << "list is empty." << std::endl;
 				else
 					for (const auto& [k, v] : pid_events) {
-						std::cout << "\t" << k << " -> {" << v.first.time_since_epoch().count() << ", " << v.second
-								  << "}" << std::endl;
+						std::cout << "\t" << k << " -> {" << v.start.time_since_epoch().count() << ", " << v.events
+								  << ", " << v.thresh << "}" << std::endl;
 					}
 			} else if (input.starts_with("set_log ")) {
 				input = input.substr(8);
@@ -227,18 +360,123 @@ int main(int argc, char** argv) {
 	}).detach();
 #endif
 
+	WatchTable table;
+	for (auto& root : a.roots) {
+		// Overlapping roots are fine, each cgroup belongs to the innermost root. Identical roots are not.
+		if (std::any_of(table.roots.begin(), table.roots.end(), [&](auto& r) { return r.path == root.path; })) {
+			spdlog::warn("Root \"{}\" was given more than once, using only the first one", root.path);
+			continue;
+		}
+		table.roots.push_back(root);
+	}
+	table.excludes.assign(a.excludes.begin(), a.excludes.end());
+
+	std::unique_ptr<AdaptiveThresholds> adaptive;
+	if (a.adaptive)
+		adaptive = std::make_unique<AdaptiveThresholds>(table.roots, a.adaptive_state);
+
+	std::unique_ptr<IoUring> ring;
+	if (a.io_uring) {
+		ring = IoUring::create(256);
+		if (ring && snapshotter)
+			spdlog::warn("--snapshot-file is given, cgroups are killed after their snapshot instead of through "
+						 "io_uring");
+	}
+
 	try {
-		Inotify i;
-		addAllRecursively(i, a.cgroup_path + a.slice_path, filename_to_listen_to,
-						  {a.cgroup_path + "/user.slice/user-0.slice"});
-		i.addFileRemovalListener([&](int wd, const std::string& /* path */) { pid_events.erase(wd); });
+		Inotify i{ring.get()};
+		KillBatch kills{ring.get(), snapshotter.get()};
+		KillPlanner planner{i, kills, a.cooldown_seconds, [&](std::string const& cgroup_dir) {
+			// Only cgroups strictly inside a root that do not contain an excluded one may be killed for their children.
+			// A root itself (e.g. machine.slice) is never killed as a whole.
+			std::string path = cgroup_dir.substr(0, cgroup_dir.length() - 1);
+			auto w = i.findWatch(path);
+			if (!w || !table.root_of.contains(*w) || table.root_at(path) >= 0)
+				return false;
+			return std::none_of(table.excludes.begin(), table.excludes.end(),
+								[&](auto& ex) { return is_inside_dir(path, ex); });
+		}};
+		i.addFileRemovalListener([&](int wd, const std::string& /* path */) {
+			auto window = pid_events.find(wd);
+			if (window != pid_events.end()) {
+				if (adaptive)
+					adaptive->release(window->second.baseline);
+				pid_events.erase(window);
+			}
+			table.root_of.erase(wd);
+			planner.forgetWatch(wd);
+		});
+		// Kill everything that triggered in one read of events at once
+		i.addIdleListener([&]() { planner.flush(); });
+		bool shutting_down = false;
+		i.addFdListener(signal_fd, [&]() {
+			struct signalfd_siginfo info;
+			if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+				spdlog::info("Received {}, shutting down", strsignal(info.ssi_signo));
+			shutting_down = true;
+		});
+
+		// Save what has been learned regularly, independent of events, so that a crash loses at most one interval
+		int save_timer_fd = -1;
+		if (adaptive && !a.adaptive_state.empty()) {
+			save_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+			struct itimerspec interval = {
+				.it_interval = {.tv_sec = AdaptiveThresholds::save_interval.count(), .tv_nsec = 0},
+				.it_value = {.tv_sec = AdaptiveThresholds::save_interval.count(), .tv_nsec = 0},
+			};
+			if (save_timer_fd < 0 || timerfd_settime(save_timer_fd, 0, &interval, nullptr)) {
+				spdlog::critical("Could not create timer to save the adaptive state: {}", strerror(errno));
+				return EXIT_FAILURE;
+			}
+			i.addFdListener(save_timer_fd, [&]() {
+				uint64_t expirations;
+				if (read(save_timer_fd, &expirations, sizeof(expirations)) < 0)
+					spdlog::trace("Could not read timerfd: {}", strerror(errno));
+				adaptive->saveIfChanged();
+			});
+		}
+
+		bool draining = false;
+		table.drain = [&]() {
+			// Walks started by the events handled here drain as well, but must not recurse
+			if (draining)
+				return;
+			draining = true;
+			while (auto e = i.pollEvent())
+				deal_with_event(i, table, planner, adaptive.get(), std::move(*e), pid_events, filename_to_listen_to);
+			draining = false;
+		};
+		auto rescan_if_needed = [&](unsigned n_roots) {
+			while (table.rescan) {
+				table.rescan = false;
+				for (unsigned r = 0; r < n_roots; r++)
+					registerRoot(i, table, r, filename_to_listen_to);
+			}
+		};
+
+		// Register the roots one after another. Events of the cgroups that are already watched are handled during the
+		// walks, so that the first root is protected as soon as possible.
+		for (unsigned r = 0; r < table.roots.size() && !shutting_down; r++) {
+			registerRoot(i, table, r, filename_to_listen_to);
 #ifdef USE_SYSTEMD
-		sd_notify(0, "READY=1");
+			if (r == 0)
+				sd_notify(0, "READY=1");
 #endif
-		while (true) {
-			struct InotifyEvent e = i.readEvent();
-			deal_with_event(i, a, std::move(e), pid_events, filename_to_listen_to);
+			table.drain();
+			rescan_if_needed(r + 1);
+		}
+		while (!shutting_down) {
+			if (auto e = i.waitEvent())
+				deal_with_event(i, table, planner, adaptive.get(), std::move(*e), pid_events, filename_to_listen_to);
+			rescan_if_needed(table.roots.size());
 		}
+#ifdef USE_SYSTEMD
+		sd_notify(0, "STOPPING=1");
+#endif
+		if (adaptive)
+			adaptive->save();
+		if (save_timer_fd >= 0)
+			close(save_timer_fd);
 	} catch (InotifyError e) {
 #ifdef USE_SYSTEMD
 		auto s = spdlog::fmt_lib::format("ERRNO={}", e.e);
@@ -246,4 +484,5 @@ int main(int argc, char** argv) {
 #endif
 		e.bail();
 	}
+	close(signal_fd);
 }
@@ -0,0 +1,260 @@
+#include "planner.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+// Returns whether the cgroup in @cgroup_dir still has processes in it (or below it). If that cannot be determined,
+// the cgroup is assumed to be populated.
+static bool is_populated(std::string const& cgroup_dir) {
+	std::string path = cgroup_dir + "cgroup.events";
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno != ENOENT;
+	char buffer[128];
+	ssize_t n_bytes = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (n_bytes < 0)
+		return true;
+	buffer[n_bytes] = '\0';
+	return !strstr(buffer, "populated 0");
+}
+
+// Returns whether processes live directly in the cgroup in @cgroup_dir (not only in its children). If that cannot be
+// determined, it is assumed that they do.
+static bool has_own_processes(std::string const& cgroup_dir) {
+	std::string path = cgroup_dir + "cgroup.procs";
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return true;
+	char c;
+	ssize_t n_bytes = read(fd, &c, 1);
+	close(fd);
+	return n_bytes != 0;
+}
+
+static std::string parent_of(std::string const& cgroup_dir) {
+	if (cgroup_dir.size() <= 1)
+		return "";
+	size_t slash = cgroup_dir.rfind('/', cgroup_dir.size() - 2);
+	return slash == std::string::npos ? "" : cgroup_dir.substr(0, slash + 1);
+}
+
+KillPlanner::KillPlanner(Inotify& inotify, KillBatch& kills, float cooldown_seconds,
+						 std::function<bool(std::string const&)>&& may_kill)
+	: inotify(inotify), kills(kills), cooldown(cooldown_seconds), may_kill(may_kill) {}
+
+bool KillPlanner::isExpired(Entry const& entry, std::chrono::time_point<std::chrono::steady_clock> now) const {
+	return (entry.state == State::COOLDOWN && now - entry.since > cooldown) ||
+		   (entry.state == State::DRAINING && now - entry.since > drain_timeout);
+}
+
+void KillPlanner::expire(std::string const& cgroup_dir) {
+	Entry& entry = cgroups.at(cgroup_dir);
+	if (entry.state == State::COOLDOWN) {
+		if (entry.suppressed)
+			spdlog::info("Cgroup \"{}\" is armed again, ignored {} trigger(s) since it was killed", cgroup_dir,
+						 entry.suppressed);
+	} else {
+		spdlog::warn("Cgroup \"{}\" is still populated {}s after it was killed, arming it again", cgroup_dir,
+					 drain_timeout.count());
+		if (entry.events_watch >= 0) {
+			by_events_watch.erase(entry.events_watch);
+			try {
+				inotify.removeWatch(entry.events_watch);
+			} catch (InotifyError e) {
+				spdlog::trace("Could not remove watch {}: {}", entry.events_watch, e.tostring());
+			}
+		}
+	}
+	cgroups.erase(cgroup_dir);
+}
+
+void KillPlanner::sweep() {
+	auto now = std::chrono::steady_clock::now();
+	if (now - last_sweep < sweep_interval)
+		return;
+	last_sweep = now;
+	std::vector<std::string> expired;
+	for (auto& [dir, entry] : cgroups)
+		if (isExpired(entry, now))
+			expired.push_back(dir);
+	for (auto& dir : expired)
+		expire(dir);
+}
+
+// Returns the entry of @cgroup_dir or of an ancestor whose kill covers it, if any. @watch belongs to @cgroup_dir, -1 if
+// it has existed for long enough to be covered in any case.
+KillPlanner::Entry* KillPlanner::activeEntryFor(std::string const& cgroup_dir, int watch) {
+	auto now = std::chrono::steady_clock::now();
+	for (std::string dir = cgroup_dir; !dir.empty(); dir = parent_of(dir)) {
+		auto it = cgroups.find(dir);
+		if (it == cgroups.end())
+			continue;
+		Entry& entry = it->second;
+
+		if (isExpired(entry, now)) {
+			expire(dir);
+			continue;
+		}
+		// A cgroup created in a killed one afterwards (e.g. a new container in a pod) was not hit by the kill
+		if (dir != cgroup_dir && watch > entry.newest_watch)
+			continue;
+		return &entry;
+	}
+	return nullptr;
+}
+
+void KillPlanner::trigger(std::string cgroup_dir, int watch) {
+	if (Entry* entry = activeEntryFor(cgroup_dir, watch)) {
+		entry->suppressed++;
+		spdlog::trace("Not killing \"{}\" again, it is being killed already", cgroup_dir);
+		return;
+	}
+	if (std::find(triggered.begin(), triggered.end(), cgroup_dir) == triggered.end())
+		triggered.push_back(std::move(cgroup_dir));
+}
+
+void KillPlanner::mergeSiblings(std::vector<std::string>& victims) {
+	bool changed = true;
+	while (changed && victims.size() > 1) {
+		changed = false;
+		std::map<std::string, std::vector<std::string>> by_parent;
+		for (auto& v : victims)
+			by_parent[parent_of(v)].push_back(v);
+
+		for (auto& [parent, children] : by_parent) {
+			if (children.size() < 2 || parent.empty() || activeEntryFor(parent, -1))
+				continue;
+			if (access((parent + "cgroup.kill").c_str(), W_OK))
+				continue;
+
+			// Killing the parent must not hit anything that killing the children would not have hit: neither its own
+			// processes nor those of its other children
+			if (has_own_processes(parent) || !may_kill(parent))
+				continue;
+			bool only_victims = true;
+			std::error_code e{};
+			for (auto const& dir_entry : std::filesystem::directory_iterator{parent, e}) {
+				if (!dir_entry.is_directory())
+					continue;
+				std::string child = dir_entry.path().string() + "/";
+				if (std::find(children.begin(), children.end(), child) == children.end() && is_populated(child)) {
+					only_victims = false;
+					break;
+				}
+			}
+			if (e || !only_victims)
+				continue;
+
+			spdlog::info("Killing \"{}\" instead of its {} triggered children", parent, children.size());
+			std::erase_if(victims, [&](auto& v) { return parent_of(v) == parent; });
+			victims.push_back(parent);
+			changed = true;
+		}
+	}
+}
+
+void KillPlanner::flush() {
+	sweep();
+	if (triggered.empty())
+		return;
+
+	std::vector<std::string> victims;
+	victims.swap(triggered);
+	// Descendants of other victims die with them anyway. erase_if() moves the victims around while it runs, so the
+	// ancestors are looked up in a copy.
+	const std::set<std::string> all_victims{victims.begin(), victims.end()};
+	std::erase_if(victims, [&](auto& v) {
+		for (std::string dir = parent_of(v); !dir.empty(); dir = parent_of(dir))
+			if (all_victims.contains(dir))
+				return true;
+		return false;
+	});
+	mergeSiblings(victims);
+
+	const int newest_watch = inotify.newestWatch();
+	for (auto& v : victims)
+		kills.add(v);
+	std::vector<std::string> const& failed = kills.flush();
+	for (auto& v : victims) {
+		if (std::find(failed.begin(), failed.end(), v) != failed.end()) {
+			// Nothing is being torn down, the next trigger has to try again
+			spdlog::warn("Could not kill \"{}\", keeping it armed", v);
+			continue;
+		}
+		startDraining(v, newest_watch);
+	}
+}
+
+void KillPlanner::startDraining(std::string const& cgroup_dir, int newest_watch) {
+	Entry& entry = cgroups[cgroup_dir] =
+		Entry{.state = State::DRAINING, .since = std::chrono::steady_clock::now(), .newest_watch = newest_watch};
+	try {
+		entry.events_watch = inotify.addWatch(cgroup_dir + "cgroup.events", IN_MODIFY);
+		by_events_watch[entry.events_watch] = cgroup_dir;
+	} catch (InotifyError e) {
+		if (e.e == ENOENT) {
+			// Already gone
+			finishDraining(cgroup_dir, entry);
+			cgroups.erase(cgroup_dir);
+			return;
+		}
+		// Not fatal, the cgroup is armed again after drain_timeout
+		spdlog::error("Could not watch \"{}cgroup.events\": {}", cgroup_dir, e.tostring());
+	}
+	// It might have been emptied before the watch was added
+	if (!is_populated(cgroup_dir))
+		finishDraining(cgroup_dir, entry);
+}
+
+void KillPlanner::finishDraining(std::string const& cgroup_dir, Entry& entry) {
+	if (entry.state != State::DRAINING)
+		return;
+	std::chrono::duration<float> d = std::chrono::steady_clock::now() - entry.since;
+	spdlog::info("Cgroup \"{}\" has been torn down after {:.3f}s", cgroup_dir, d.count());
+	entry.state = State::COOLDOWN;
+	entry.since = std::chrono::steady_clock::now();
+
+	int watch = entry.events_watch;
+	entry.events_watch = -1;
+	if (watch >= 0 && by_events_watch.erase(watch)) {
+		try {
+			inotify.removeWatch(watch);
+		} catch (InotifyError e) {
+			spdlog::trace("Could not remove watch {}: {}", watch, e.tostring());
+		}
+	}
+}
+
+bool KillPlanner::handleEvent(InotifyEvent const& e) {
+	auto it = by_events_watch.find(e.watch);
+	if (it == by_events_watch.end())
+		return false;
+	std::string cgroup_dir = it->second;
+	if ((e.event_mask & IN_MODIFY) && !is_populated(cgroup_dir))
+		finishDraining(cgroup_dir, cgroups.at(cgroup_dir));
+	return true;
+}
+
+void KillPlanner::forgetWatch(int watch) {
+	auto it = by_events_watch.find(watch);
+	if (it == by_events_watch.end())
+		return;
+	// The cgroup has been removed
+	std::string cgroup_dir = it->second;
+	by_events_watch.erase(it);
+	Entry& entry = cgroups.at(cgroup_dir);
+	entry.events_watch = -1;
+	finishDraining(cgroup_dir, entry);
+	// Nothing is left to protect. A new cgroup with the same name is a different one and starts armed.
+	cgroups.erase(cgroup_dir);
+}
@@ -0,0 +1,666 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <poll.h>
+#include <string.h>
+#include <string_view>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+using namespace snapshot;
+
+static constexpr size_t align8(size_t n) {
+	return (n + 7) & ~size_t{7};
+}
+
+static uint64_t nanoseconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static bool write_all(int fd, const char* data) {
+	const size_t len = strlen(data);
+	ssize_t n_bytes = write(fd, data, len);
+	return n_bytes >= 0 && static_cast<size_t>(n_bytes) == len;
+}
+
+static bool write_to(int dir_fd, const char* filename, const char* data) {
+	int fd = openat(dir_fd, filename, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	bool ok = write_all(fd, data);
+	close(fd);
+	return ok;
+}
+
+// The record area of @h must hold at least one record and records must stay 8-byte aligned in it.
+static bool is_valid_geometry(FileHeader const& h) {
+	return h.capacity >= Snapshotter::max_record_size && h.capacity % 8 == 0 && h.head <= h.capacity &&
+		   h.head % 8 == 0 && h.tail <= h.capacity && h.tail % 8 == 0 && h.tail_seq <= h.next_seq;
+}
+
+__attribute__((noreturn)) void SnapshotError::bail() const {
+	spdlog::critical("{}: {} (errno {})", msg, strerror(e), e);
+	exit(EXIT_FAILURE);
+}
+
+// The snapshotter whose frozen cgroups are killed when the process exits without destroying it, e.g. in bail()
+static std::atomic<Snapshotter*> active_snapshotter{nullptr};
+
+static void kill_pending_at_exit() {
+	if (Snapshotter* s = active_snapshotter.load())
+		s->kill_pending();
+}
+
+// The files of a cgroup that end up in a record, in the order they are written.
+static constexpr std::pair<SectionType, const char*> cgroup_files[] = {
+	{PIDS_CURRENT, "pids.current"}, {PIDS_PEAK, "pids.peak"}, {PIDS_MAX, "pids.max"},
+	{PIDS_EVENTS, "pids.events"},   {CPU_STAT, "cpu.stat"},   {MEMORY_CURRENT, "memory.current"},
+};
+static constexpr size_t n_cgroup_files = sizeof(cgroup_files) / sizeof(*cgroup_files);
+
+struct Snapshotter::Job {
+	std::string path;
+	int dir_fd = -1;
+	int kill_fd = -1;
+	int procs_fd = -1;
+	int events_fd = -1;
+	int file_fds[n_cgroup_files];
+	uint64_t realtime_ns;
+	uint32_t flags = 0;
+
+	Job() {
+		std::fill(std::begin(file_fds), std::end(file_fds), -1);
+	}
+	~Job() {
+		for (int fd : file_fds)
+			if (fd >= 0)
+				close(fd);
+		for (int fd : {dir_fd, kill_fd, procs_fd, events_fd})
+			if (fd >= 0)
+				close(fd);
+	}
+};
+
+Snapshotter::Snapshotter(std::string const& path, uint64_t capacity)
+	: record(max_record_size), read_buffer(max_record_size) {
+	if (capacity < max_record_size || capacity % 8)
+		throw SnapshotError{EINVAL, spdlog::fmt_lib::format("Snapshot size must be a multiple of 8 and at least {} bytes",
+															max_record_size)};
+	pids.reserve(max_processes);
+	records.reserve(max_queued_jobs * max_record_size);
+
+	file_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (file_fd < 0)
+		throw SnapshotError{errno, "Could not open snapshot file \"" + path + "\""};
+
+	ssize_t n_bytes = pread(file_fd, &header, sizeof(header), 0);
+	if (n_bytes < 0) {
+		int e = errno;
+		close(file_fd);
+		throw SnapshotError{e, "Could not read snapshot file \"" + path + "\""};
+	}
+	// Older versions could not tell which records are intact, their records cannot be trusted
+	bool old_version = static_cast<size_t>(n_bytes) >= offsetof(FileHeader, header_size) &&
+					   !memcmp(header.magic, file_magic, sizeof(file_magic)) && header.version < file_version;
+	if (old_version)
+		spdlog::warn("Snapshot file \"{}\" has an older format, discarding its snapshots", path);
+	if (n_bytes == 0 || old_version) {
+		memcpy(header.magic, file_magic, sizeof(header.magic));
+		header.version = file_version;
+		header.header_size = sizeof(header);
+		header.capacity = capacity;
+		header.head = 0;
+		header.next_seq = 0;
+		header.tail = 0;
+		header.tail_seq = 0;
+	} else if (static_cast<size_t>(n_bytes) < sizeof(header) || memcmp(header.magic, file_magic, sizeof(file_magic)) ||
+			   header.version != file_version || header.header_size != sizeof(header)) {
+		close(file_fd);
+		throw SnapshotError{EINVAL, "\"" + path + "\" exists, but is not a snapshot file"};
+	} else if (!is_valid_geometry(header)) {
+		close(file_fd);
+		throw SnapshotError{EINVAL, spdlog::fmt_lib::format("Snapshot file \"{}\" is corrupt (capacity {}, head {})", path,
+															header.capacity, header.head)};
+	} else if (header.capacity != capacity) {
+		spdlog::warn("Snapshot file \"{}\" already exists with a size of {} bytes, keeping that size", path,
+					 header.capacity);
+	}
+
+	if (ftruncate(file_fd, sizeof(header) + header.capacity) || pwrite(file_fd, &header, sizeof(header), 0) < 0) {
+		int e = errno;
+		close(file_fd);
+		throw SnapshotError{e, "Could not initialize snapshot file \"" + path + "\""};
+	}
+	spdlog::debug("Writing snapshots to \"{}\" (next record #{})", path, header.next_seq);
+
+	static const bool exit_handler_registered = atexit(kill_pending_at_exit) == 0;
+	if (!exit_handler_registered)
+		spdlog::warn("Could not register exit handler, frozen cgroups might stay frozen if forkbomb-killer crashes");
+	active_snapshotter = this;
+	worker = std::thread([this]() { run(); });
+}
+
+Snapshotter::~Snapshotter() {
+	{
+		std::lock_guard lock{mutex};
+		stopping = true;
+	}
+	cv.notify_one();
+	worker.join();
+	active_snapshotter = nullptr;
+	for (Job* job : queue)
+		delete job;
+	close(file_fd);
+}
+
+bool Snapshotter::kill_and_capture(std::string const& cgroup_dir) {
+	auto job = std::make_unique<Job>();
+	job->realtime_ns = nanoseconds(CLOCK_REALTIME);
+	job->path = cgroup_dir;
+
+	job->dir_fd = open(cgroup_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (job->dir_fd < 0) {
+		spdlog::error("Could not kill: open \"{}\" failed: {}", cgroup_dir, strerror(errno));
+		return false;
+	}
+	job->kill_fd = openat(job->dir_fd, "cgroup.kill", O_WRONLY | O_CLOEXEC);
+	if (job->kill_fd < 0) {
+		spdlog::error("Could not kill: open \"{}cgroup.kill\" as write-only failed: {}", cgroup_dir, strerror(errno));
+		return false;
+	}
+
+	bool queue_full;
+	{
+		std::lock_guard lock{mutex};
+		queue_full = queue.size() >= max_queued_jobs;
+	}
+
+	// A frozen cgroup cannot fork anymore, so we can take our time to look at it before killing it.
+	if (!queue_full && write_to(job->dir_fd, "cgroup.freeze", "1\n")) {
+		job->flags |= FROZEN_DURING_CAPTURE;
+	} else {
+		job->flags |= KILLED_BEFORE_CAPTURE;
+		if (!write_all(job->kill_fd, "1\n")) {
+			spdlog::error("Could not kill: writing \"1\\n\" into {}cgroup.kill failed: {}", cgroup_dir, strerror(errno));
+			job->flags |= KILL_FAILED;
+		}
+	}
+
+	if (queue_full) {
+		spdlog::warn("Too many pending snapshots, not capturing \"{}\"", cgroup_dir);
+		return !(job->flags & KILL_FAILED);
+	}
+
+	// Open everything now, the cgroup might be removed as soon as it is empty
+	job->procs_fd = openat(job->dir_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	if (job->flags & FROZEN_DURING_CAPTURE)
+		job->events_fd = openat(job->dir_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+	for (size_t i = 0; i < n_cgroup_files; i++)
+		job->file_fds[i] = openat(job->dir_fd, cgroup_files[i].second, O_RDONLY | O_CLOEXEC);
+
+	bool killed = !(job->flags & KILL_FAILED);
+	{
+		std::lock_guard lock{mutex};
+		queue.push_back(job.release());
+	}
+	cv.notify_one();
+	return killed;
+}
+
+// Kill the frozen cgroup in @path and thaw it. Returns false if the kill failed.
+static bool kill_and_thaw(int dir_fd, int kill_fd, std::string const& path) {
+	bool killed = write_all(kill_fd, "1\n");
+	if (!killed)
+		spdlog::error("Could not kill: writing \"1\\n\" into {}cgroup.kill failed: {}", path, strerror(errno));
+	// The cgroup itself (e.g. a user slice) might be reused, so it must not stay frozen.
+	// The kill has already been delivered to every process in it, so thawing it is safe.
+	if (!write_to(dir_fd, "cgroup.freeze", "0\n"))
+		spdlog::error("Could not thaw cgroup \"{}\": {}", path, strerror(errno));
+	return killed;
+}
+
+void Snapshotter::kill_pending() {
+	std::lock_guard lock{mutex};
+	for (Job* job : queue) {
+		if (!(job->flags & FROZEN_DURING_CAPTURE))
+			continue;
+		job->flags = (job->flags & ~FROZEN_DURING_CAPTURE) | KILLED_BEFORE_CAPTURE;
+		if (!kill_and_thaw(job->dir_fd, job->kill_fd, job->path))
+			job->flags |= KILL_FAILED;
+	}
+	// The worker might be anywhere in capture() of the first job that has not been captured yet, so the flags of the
+	// batch are left alone. Killing twice does no harm.
+	for (size_t j = n_captured; j < batch.size(); j++)
+		if (batch[j]->flags & FROZEN_DURING_CAPTURE)
+			kill_and_thaw(batch[j]->dir_fd, batch[j]->kill_fd, batch[j]->path);
+}
+
+void Snapshotter::run() {
+	std::vector<Job*> done;
+	while (true) {
+		{
+			std::unique_lock lock{mutex};
+			cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			// Every queued cgroup is frozen and waits for its kill, none of them may wait for a record to hit the disk
+			batch.assign(queue.begin(), queue.end());
+			queue.clear();
+			n_captured = 0;
+		}
+
+		records.clear();
+		for (Job* job : batch) {
+			capture(*job);
+			size_t length = reinterpret_cast<RecordHeader*>(record.data())->length;
+			records.insert(records.end(), record.begin(), record.begin() + length);
+			std::lock_guard lock{mutex};
+			n_captured++;
+		}
+		persist();
+		{
+			std::lock_guard lock{mutex};
+			done.swap(batch);
+		}
+		for (Job* job : done)
+			delete job;
+		done.clear();
+	}
+}
+
+// Wait until cgroup.events (@fd) reports the cgroup as frozen, for at most @timeout. The kernel signals every change of
+// cgroup.events with POLLPRI. Returns whether the cgroup is frozen.
+static bool wait_frozen(int fd, std::chrono::milliseconds timeout) {
+	if (fd < 0)
+		return false;
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	char buffer[128];
+	while (true) {
+		ssize_t n_bytes = pread(fd, buffer, sizeof(buffer) - 1, 0);
+		if (n_bytes < 0)
+			return false;
+		buffer[n_bytes] = '\0';
+		if (strstr(buffer, "frozen 1"))
+			return true;
+
+		auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (left.count() <= 0)
+			return false;
+		struct pollfd p = {.fd = fd, .events = POLLPRI, .revents = 0};
+		if (poll(&p, 1, left.count()) < 0 && errno != EINTR)
+			return false;
+	}
+}
+
+void Snapshotter::capture(Job& job) {
+	uint64_t start = nanoseconds(CLOCK_MONOTONIC);
+
+	RecordHeader* r = reinterpret_cast<RecordHeader*>(record.data());
+	*r = RecordHeader{
+		.magic = record_magic,
+		.length = 0,
+		.seq = 0, // assigned when the record is written
+		.realtime_ns = static_cast<int64_t>(job.realtime_ns),
+		.capture_ns = 0,
+		.flags = job.flags,
+		.n_sections = 0,
+	};
+	// Until the freeze is complete, processes can still fork and the process list might miss some of them
+	if ((job.flags & FROZEN_DURING_CAPTURE) && !wait_frozen(job.events_fd, freeze_timeout)) {
+		spdlog::warn("Cgroup \"{}\" did not freeze within {}ms, capturing it anyway", job.path, freeze_timeout.count());
+		r->flags &= ~FROZEN_DURING_CAPTURE;
+	}
+	size_t offset = sizeof(RecordHeader);
+	offset = append_section(offset, CGROUP_PATH, job.path.data(), job.path.size());
+	for (size_t i = 0; i < n_cgroup_files; i++)
+		offset = append_file(offset, cgroup_files[i].first, job.file_fds[i]);
+
+	pids.clear();
+	collect_pids(job.dir_fd, job.procs_fd, 0);
+	for (int32_t pid : pids)
+		offset = append_process(offset, pid);
+
+	if ((job.flags & FROZEN_DURING_CAPTURE) && !kill_and_thaw(job.dir_fd, job.kill_fd, job.path))
+		r->flags |= KILL_FAILED;
+
+	r->capture_ns = nanoseconds(CLOCK_MONOTONIC) - start;
+	r->length = align8(offset);
+	spdlog::debug("Captured snapshot of \"{}\" ({} bytes, {} processes, {:.3f}ms)", job.path, r->length, pids.size(),
+				  r->capture_ns / 1e6);
+}
+
+size_t Snapshotter::append_section(size_t offset, uint16_t type, const char* data, size_t len) {
+	RecordHeader* r = reinterpret_cast<RecordHeader*>(record.data());
+	if (offset + sizeof(SectionHeader) + align8(len) > record.size()) {
+		r->flags |= TRUNCATED;
+		return offset;
+	}
+	SectionHeader s{.type = type, .reserved = 0, .length = static_cast<uint32_t>(len)};
+	memcpy(record.data() + offset, &s, sizeof(s));
+	memcpy(record.data() + offset + sizeof(s), data, len);
+	memset(record.data() + offset + sizeof(s) + len, 0, align8(len) - len);
+	r->n_sections++;
+	return offset + sizeof(s) + align8(len);
+}
+
+// Read the whole file behind @fd into @buffer. Returns the number of bytes read or -1.
+static ssize_t pread_all(int fd, std::vector<char>& buffer) {
+	size_t n = 0;
+	while (n < buffer.size()) {
+		ssize_t n_bytes = pread(fd, buffer.data() + n, buffer.size() - n, n);
+		if (n_bytes < 0)
+			return n ? static_cast<ssize_t>(n) : -1;
+		if (n_bytes == 0)
+			break;
+		n += n_bytes;
+	}
+	return n;
+}
+
+size_t Snapshotter::append_file(size_t offset, uint16_t type, int fd) {
+	if (fd < 0)
+		return offset;
+	ssize_t n = pread_all(fd, read_buffer);
+	if (n < 0)
+		return offset;
+	return append_section(offset, type, read_buffer.data(), n);
+}
+
+void Snapshotter::collect_pids(int dir_fd, int procs_fd, unsigned depth) {
+	bool own_procs_fd = procs_fd < 0;
+	if (own_procs_fd)
+		procs_fd = openat(dir_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	if (procs_fd >= 0) {
+		ssize_t n = pread_all(procs_fd, read_buffer);
+		if (own_procs_fd)
+			close(procs_fd);
+		for (ssize_t i = 0; i < n && pids.size() < max_processes;) {
+			int32_t pid = 0;
+			for (; i < n && read_buffer[i] >= '0' && read_buffer[i] <= '9'; i++)
+				pid = pid * 10 + (read_buffer[i] - '0');
+			for (; i < n && (read_buffer[i] < '0' || read_buffer[i] > '9'); i++)
+				;
+			if (pid)
+				pids.push_back(pid);
+		}
+	}
+	if (pids.size() >= max_processes) {
+		reinterpret_cast<RecordHeader*>(record.data())->flags |= TRUNCATED;
+		return;
+	}
+
+	// cgroup.procs only lists the processes directly in this cgroup, descend into the child cgroups as well
+	if (depth >= 16)
+		return;
+	int dup_fd = dup(dir_fd);
+	if (dup_fd < 0)
+		return;
+	DIR* dir = fdopendir(dup_fd);
+	if (!dir) {
+		close(dup_fd);
+		return;
+	}
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_type != DT_DIR || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		int child_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (child_fd < 0)
+			continue;
+		collect_pids(child_fd, -1, depth + 1);
+		close(child_fd);
+		if (pids.size() >= max_processes)
+			break;
+	}
+	closedir(dir);
+}
+
+size_t Snapshotter::append_process(size_t offset, int32_t pid) {
+	char path[32];
+	ProcessEntry p{.pid = pid, .ppid = 0, .comm_len = 0, .cmdline_len = 0};
+	std::string_view comm;
+
+	// Format of /proc/<pid>/stat: "pid (comm) state ppid ...", where comm may contain any character
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return offset; // already gone
+	ssize_t n = pread_all(fd, read_buffer);
+	close(fd);
+	std::string_view stat{read_buffer.data(), static_cast<size_t>(std::max<ssize_t>(n, 0))};
+	size_t comm_start = stat.find('('), comm_end = stat.rfind(')');
+	if (comm_start == std::string_view::npos || comm_end == std::string_view::npos || comm_end < comm_start)
+		return offset;
+	comm = stat.substr(comm_start + 1, comm_end - comm_start - 1);
+	p.ppid = atoi(read_buffer.data() + std::min(comm_end + 4, stat.size()));
+	p.comm_len = comm.size();
+
+	// Assemble the section directly in the read buffer: entry, comm, cmdline
+	static constexpr size_t max_cmdline = 1024;
+	std::vector<char>& b = read_buffer;
+	memmove(b.data() + sizeof(p), comm.data(), comm.size());
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		n = pread(fd, b.data() + sizeof(p) + p.comm_len, max_cmdline, 0);
+		close(fd);
+		p.cmdline_len = n > 0 ? n : 0;
+	}
+	memcpy(b.data(), &p, sizeof(p));
+	return append_section(offset, PROCESS, b.data(), sizeof(p) + p.comm_len + p.cmdline_len);
+}
+
+// Drop the oldest record. Its header is read back from the file: the walk from the tail only ever lands on headers
+// written by us, so their lengths can be trusted.
+void Snapshotter::drop_oldest() {
+	RecordHeader r;
+	if (pread(file_fd, &r, sizeof(r), sizeof(header) + header.tail) != sizeof(r) || r.magic != record_magic ||
+		r.length < sizeof(r) || r.length % 8 || header.tail + r.length > header.capacity) {
+		spdlog::error("Snapshot #{} cannot be read back, dropping all snapshots", header.tail_seq);
+		header.tail_seq = header.next_seq;
+		return;
+	}
+	header.tail += r.length;
+	header.tail_seq++;
+	uint32_t magic = 0;
+	if (header.tail + sizeof(uint64_t) > header.capacity ||
+		(pread(file_fd, &magic, sizeof(magic), sizeof(header) + header.tail) == sizeof(magic) && magic == wrap_magic))
+		header.tail = 0;
+}
+
+void Snapshotter::persist() {
+	if (records.empty())
+		return;
+	for (size_t offset = 0; offset < records.size();) {
+		RecordHeader* r = reinterpret_cast<RecordHeader*>(records.data() + offset);
+		offset += r->length;
+		r->seq = header.next_seq;
+
+		// Drop the oldest records until the new one does not overlap any of them. If it does not fit behind the head,
+		// everything that is left behind the head is dropped first, since it is older than what is in front of it.
+		uint64_t old_tail_seq = header.tail_seq;
+		bool wrap = header.head + r->length > header.capacity;
+		if (wrap)
+			while (header.tail_seq != header.next_seq && header.tail >= header.head)
+				drop_oldest();
+		uint64_t start = wrap ? 0 : header.head;
+		while (header.tail_seq != header.next_seq && header.tail >= start && header.tail < start + r->length)
+			drop_oldest();
+		// The header must not point to records that are overwritten, even if we crash in between
+		if (header.tail_seq != old_tail_seq && pwrite(file_fd, &header, sizeof(header), 0) < 0)
+			spdlog::error("Could not update snapshot file header: {}", strerror(errno));
+
+		if (wrap) {
+			if (header.head + sizeof(uint64_t) <= header.capacity) {
+				uint32_t marker[2] = {wrap_magic, 0};
+				if (pwrite(file_fd, marker, sizeof(marker), sizeof(header) + header.head) < 0)
+					spdlog::error("Could not write snapshot wrap marker: {}", strerror(errno));
+			}
+			header.head = 0;
+		}
+		if (header.tail_seq == header.next_seq)
+			header.tail = header.head;
+
+		if (pwrite(file_fd, r, r->length, sizeof(header) + header.head) != r->length) {
+			spdlog::error("Could not write snapshot #{}: {}", r->seq, strerror(errno));
+			continue;
+		}
+		header.head += r->length;
+		header.next_seq++;
+	}
+	// One sync for the whole batch
+	if (pwrite(file_fd, &header, sizeof(header), 0) < 0 || fdatasync(file_fd))
+		spdlog::error("Could not update snapshot file header: {}", strerror(errno));
+}
+
+static std::string format_time(int64_t realtime_ns) {
+	time_t t = realtime_ns / 1000000000;
+	struct tm tm;
+	char buf[32];
+	localtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%F %T", &tm);
+	return spdlog::fmt_lib::format("{}.{:03}", buf, realtime_ns / 1000000 % 1000);
+}
+
+static void dump_record(const char* data, std::ostream& out) {
+	const RecordHeader* r = reinterpret_cast<const RecordHeader*>(data);
+	out << spdlog::fmt_lib::format("#{} at {}, captured in {:.3f}ms", r->seq, format_time(r->realtime_ns),
+								   r->capture_ns / 1e6);
+	if (r->flags & FROZEN_DURING_CAPTURE)
+		out << ", frozen";
+	if (r->flags & KILLED_BEFORE_CAPTURE)
+		out << ", captured after kill";
+	if (r->flags & KILL_FAILED)
+		out << ", KILL FAILED";
+	if (r->flags & TRUNCATED)
+		out << ", truncated";
+	out << '\n';
+
+	struct Process {
+		int32_t ppid;
+		std::string_view comm;
+		std::string cmdline;
+	};
+	std::map<int32_t, Process> processes;
+
+	size_t offset = sizeof(RecordHeader);
+	for (uint32_t i = 0; i < r->n_sections && offset + sizeof(SectionHeader) <= r->length; i++) {
+		const SectionHeader* s = reinterpret_cast<const SectionHeader*>(data + offset);
+		offset += sizeof(SectionHeader);
+		if (offset + s->length > r->length)
+			break;
+		std::string_view payload{data + offset, s->length};
+		offset += align8(s->length);
+
+		std::string_view name;
+		switch (s->type) {
+			case CGROUP_PATH: name = "cgroup"; break;
+			case PIDS_CURRENT: name = "pids.current"; break;
+			case PIDS_PEAK: name = "pids.peak"; break;
+			case PIDS_MAX: name = "pids.max"; break;
+			case PIDS_EVENTS: name = "pids.events"; break;
+			case CPU_STAT: name = "cpu.stat"; break;
+			case MEMORY_CURRENT: name = "memory.current"; break;
+			case PROCESS: {
+				ProcessEntry p;
+				if (payload.size() < sizeof(p))
+					continue;
+				memcpy(&p, payload.data(), sizeof(p));
+				if (sizeof(p) + p.comm_len + p.cmdline_len > payload.size())
+					continue;
+				std::string cmdline{payload.substr(sizeof(p) + p.comm_len, p.cmdline_len)};
+				std::replace(cmdline.begin(), cmdline.end(), '\0', ' ');
+				processes[p.pid] = {p.ppid, payload.substr(sizeof(p), p.comm_len), std::move(cmdline)};
+				continue;
+			}
+			default: continue;
+		}
+		while (payload.ends_with('\n'))
+			payload.remove_suffix(1);
+		if (payload.find('\n') == std::string_view::npos) {
+			out << "  " << name << ": " << payload << '\n';
+		} else {
+			out << "  " << name << ":\n";
+			for (size_t start = 0; start <= payload.size();) {
+				size_t end = std::min(payload.find('\n', start), payload.size());
+				out << "    " << payload.substr(start, end - start) << '\n';
+				start = end + 1;
+			}
+		}
+	}
+
+	if (processes.empty())
+		return;
+	out << "  processes (" << processes.size() << "):\n";
+	std::multimap<int32_t, int32_t> children;
+	for (auto& [pid, p] : processes)
+		children.emplace(p.ppid, pid);
+	std::function<void(int32_t, unsigned)> print_tree = [&](int32_t pid, unsigned depth) {
+		auto& p = processes.at(pid);
+		out << spdlog::fmt_lib::format("    {:{}}{} [{}] {}\n", "", 2 * depth, pid, p.comm, p.cmdline);
+		auto [begin, end] = children.equal_range(pid);
+		for (auto it = begin; it != end; it++)
+			print_tree(it->second, depth + 1);
+	};
+	for (auto& [pid, p] : processes)
+		if (!processes.contains(p.ppid))
+			print_tree(pid, 0);
+}
+
+void Snapshotter::dump(std::string const& path, std::ostream& out) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw SnapshotError{errno, "Could not open snapshot file \"" + path + "\""};
+
+	FileHeader h;
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, file_magic, sizeof(file_magic)) ||
+		h.version != file_version || h.header_size != sizeof(h)) {
+		close(fd);
+		throw SnapshotError{EINVAL, "\"" + path + "\" is not a snapshot file"};
+	}
+	// Never trust the header with the size of the allocation, the file has to be that large
+	struct stat st;
+	if (!is_valid_geometry(h) || fstat(fd, &st) || static_cast<uint64_t>(st.st_size) < sizeof(h) + h.capacity) {
+		close(fd);
+		throw SnapshotError{EINVAL, "Snapshot file \"" + path + "\" is corrupt"};
+	}
+	std::vector<char> data(h.capacity);
+	ssize_t n_bytes = pread(fd, data.data(), data.size(), sizeof(h));
+	int e = errno;
+	close(fd);
+	if (n_bytes < 0 || static_cast<size_t>(n_bytes) != data.size())
+		throw SnapshotError{n_bytes < 0 ? e : EIO, "Could not read snapshot file \"" + path + "\""};
+
+	// Walk the records from the oldest one. Every offset is computed from lengths written by us, so the data that the
+	// captured processes control is never mistaken for a record.
+	std::vector<size_t> records;
+	size_t offset = h.tail;
+	for (uint64_t seq = h.tail_seq; seq < h.next_seq; seq++) {
+		if (offset + sizeof(uint64_t) > data.size() ||
+			*reinterpret_cast<const uint32_t*>(data.data() + offset) == wrap_magic)
+			offset = 0;
+		const RecordHeader* r = reinterpret_cast<const RecordHeader*>(data.data() + offset);
+		if (offset + sizeof(RecordHeader) > data.size() || r->magic != record_magic || r->seq != seq ||
+			r->length < sizeof(RecordHeader) || r->length % 8 || offset + r->length > data.size())
+			throw SnapshotError{EINVAL, spdlog::fmt_lib::format("Snapshot #{} in \"{}\" is corrupt", seq, path)};
+		records.push_back(offset);
+		offset += r->length;
+	}
+
+	out << records.size() << " snapshot(s) in \"" << path << "\"\n";
+	for (size_t offset : records)
+		dump_record(data.data() + offset, out);
+	out << std::flush;
+}
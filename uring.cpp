@@ -0,0 +1,216 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template <typename T>
+static T* at_offset(void* base, unsigned offset) {
+	return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+std::unique_ptr<IoUring> IoUring::create(unsigned entries) {
+	std::unique_ptr<IoUring> r{new IoUring()};
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->ring_fd = io_uring_setup(entries, &p);
+	if (r->ring_fd < 0) {
+		spdlog::info("io_uring is not available: {}", strerror(errno));
+		return nullptr;
+	}
+	r->sq_entries = p.sq_entries;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_size = r->cq_size = std::max(r->sq_size, r->cq_size);
+
+	r->sq_ptr = mmap(nullptr, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd,
+					 IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = nullptr;
+		spdlog::info("io_uring is not available: mapping the submission queue failed: {}", strerror(errno));
+		return nullptr;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(nullptr, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd,
+						 IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = nullptr;
+			spdlog::info("io_uring is not available: mapping the completion queue failed: {}", strerror(errno));
+			return nullptr;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(nullptr, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd,
+					  IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		spdlog::info("io_uring is not available: mapping the SQEs failed: {}", strerror(errno));
+		return nullptr;
+	}
+	r->sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+	r->sq_head = at_offset<unsigned>(r->sq_ptr, p.sq_off.head);
+	r->sq_tail = at_offset<unsigned>(r->sq_ptr, p.sq_off.tail);
+	r->sq_mask = at_offset<unsigned>(r->sq_ptr, p.sq_off.ring_mask);
+	r->sq_array = at_offset<unsigned>(r->sq_ptr, p.sq_off.array);
+	r->cq_head = at_offset<unsigned>(r->cq_ptr, p.cq_off.head);
+	r->cq_tail = at_offset<unsigned>(r->cq_ptr, p.cq_off.tail);
+	r->cq_mask = at_offset<unsigned>(r->cq_ptr, p.cq_off.ring_mask);
+	r->cqes = at_offset<struct io_uring_cqe>(r->cq_ptr, p.cq_off.cqes);
+	r->local_tail = *r->sq_tail;
+
+	// Hard links need 5.5, the operations below 5.6. The probe itself is only available since 5.6 as well.
+	constexpr unsigned n_ops = 64;
+	union {
+		struct io_uring_probe probe;
+		char storage[sizeof(struct io_uring_probe) + n_ops * sizeof(struct io_uring_probe_op)];
+	} probe;
+	memset(&probe, 0, sizeof(probe));
+	if (io_uring_register(r->ring_fd, IORING_REGISTER_PROBE, &probe, n_ops) < 0) {
+		spdlog::info("io_uring is not available: probing supported operations failed: {}", strerror(errno));
+		return nullptr;
+	}
+	for (unsigned op : {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_POLL_ADD,
+						IORING_OP_ASYNC_CANCEL}) {
+		if (op > probe.probe.last_op || !(probe.probe.ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			spdlog::info("io_uring is not available: operation {} is not supported by this kernel", op);
+			return nullptr;
+		}
+	}
+
+	spdlog::debug("Using io_uring with {} entries", r->sq_entries);
+	return r;
+}
+
+IoUring::~IoUring() {
+	if (sqes)
+		munmap(sqes, sqes_size);
+	if (cq_ptr && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_size);
+	if (sq_ptr)
+		munmap(sq_ptr, sq_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+}
+
+unsigned IoUring::space_left() const {
+	return sq_entries - (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+}
+
+struct io_uring_sqe* IoUring::get_sqe() {
+	if (!space_left())
+		return nullptr;
+	unsigned idx = local_tail & *sq_mask;
+	struct io_uring_sqe* sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	local_tail++;
+	to_submit++;
+	return sqe;
+}
+
+int IoUring::submit(unsigned wait_nr) {
+	__atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+	unsigned n = to_submit;
+	to_submit = 0;
+
+	// If the wait is interrupted after the SQEs have been consumed, the kernel returns their number instead of EINTR,
+	// so retrying on EINTR never submits anything twice. The kernel may also consume only some of the SQEs (then it
+	// does not wait at all), the rest is submitted again until all of them are gone.
+	unsigned consumed = 0;
+	while (true) {
+		int ret = io_uring_enter(ring_fd, n - consumed, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 || (ret == 0 && consumed < n)) {
+			int e = ret < 0 ? errno : EAGAIN;
+			// Drop the SQEs that have not been consumed, so that they are not submitted by accident with the next batch.
+			local_tail = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+			return -e;
+		}
+		consumed += ret;
+		if (consumed >= n)
+			return consumed;
+	}
+}
+
+bool IoUring::pop_cqe(struct io_uring_cqe& cqe) {
+	unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	cqe = cqes[head & *cq_mask];
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+int IoUring::reap(unsigned n_completions, const std::function<void(const struct io_uring_cqe&)>& handler) {
+	struct io_uring_cqe cqe;
+	while (n_completions) {
+		if (!pop_cqe(cqe)) {
+			// Nothing is left to submit, this only waits
+			int ret = submit(n_completions);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		if (cqe.user_data & persistent) {
+			if (persistent_handler)
+				persistent_handler(cqe);
+			continue;
+		}
+		handler(cqe);
+		n_completions--;
+	}
+	return 0;
+}
+
+int IoUring::submit_and_wait(unsigned n_completions, const std::function<void(const struct io_uring_cqe&)>& handler) {
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	int ret = submit(n_completions);
+	if (ret < 0) {
+		// Whatever has been consumed before the failure completes anyway. Its completions must not end up in the next
+		// batch, and the caller has to learn about them (e.g. to close the files that have been opened).
+		unsigned consumed = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - head;
+		reap(consumed, handler);
+		return ret;
+	}
+	return reap(n_completions, handler);
+}
+
+void IoUring::set_persistent_handler(std::function<void(const struct io_uring_cqe&)>&& handler) {
+	persistent_handler = handler;
+}
+
+int IoUring::submit_persistent(bool wait) {
+	if (wait || to_submit) {
+		int ret = submit(wait ? 1 : 0);
+		if (ret < 0)
+			return ret;
+	}
+	struct io_uring_cqe cqe;
+	while (pop_cqe(cqe))
+		if (persistent_handler)
+			persistent_handler(cqe);
+	return 0;
+}